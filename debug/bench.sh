@@ -1,9 +1,17 @@
+# Run the load generator on a local cluster of two storages, the third
+# storage is appended during the reshard scenario.
+# Merger micro-benchmark is a separate target: make merger_bench
+cd "$(dirname "$0")"
 killall tarantool
-rm *.snap
-rm m1.log
-rm work/m2.log
-rm work/*.snap
+rm -rf 33301 33302 33303
+mkdir 33301 33302 33303
 
-tarantool master.lua &
-tarantool master1.lua &
+S1=localhost:33301
+S2=localhost:33302
+S3=localhost:33303
 
+tarantool storage.lua 33302 $S1 $S2 &
+tarantool storage.lua 33303 $S1 $S2 $S3 &
+tarantool load.lua 33301 $S1 $S2 -- $S3
+
+killall tarantool
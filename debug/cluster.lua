@@ -0,0 +1,44 @@
+--[[
+Configuration shared by the benchmark instances, see bench.sh.
+Parses <port> <server uri>... [-- <new server uri>] arguments, configures
+box and creates the schema. Returns shard configuration and the uri of the
+server to append, if any.
+]]--
+local port = tonumber(arg[1])
+local servers = {}
+local new_server = nil
+for i = 2, #arg do
+    if arg[i] == '--' then
+        new_server = arg[i + 1]
+        break
+    end
+    table.insert(servers, { uri = arg[i], zone = tostring(i - 2) })
+end
+
+local cfg = {
+    servers = servers;
+    login = 'tester';
+    password = 'pass';
+    redundancy = 1;
+    binary = port;
+}
+
+box.cfg {
+    slab_alloc_arena = 1.0;
+    wal_mode = 'none';
+    logger = 'storage.log';
+    work_dir = tostring(port);
+    listen = cfg.binary;
+}
+
+if not box.space.demo then
+    box.schema.user.create(cfg.login, { password = cfg.password })
+    box.schema.user.grant(cfg.login, 'read,write,execute', 'universe')
+
+    local demo = box.schema.create_space('demo')
+    demo:create_index('primary', {type = 'tree', parts = {1, 'num'}})
+    demo:create_index('value', {type = 'tree', parts = {2, 'num'},
+                                unique = false})
+end
+
+return cfg, new_server
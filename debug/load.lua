@@ -0,0 +1,157 @@
+#!/usr/bin/env tarantool
+--[[
+Load generator of the benchmark cluster, see bench.sh. The instance is
+the first storage and the router. Each scenario is run by BENCH_FIBERS
+fibers for BENCH_DURATION seconds, throughput and latency percentiles
+are printed to stdout.
+Usage: tarantool load.lua <port> <server uri>... -- <new server uri>
+The new server is appended to the cluster for the reshard scenario.
+]]--
+shard = require('shard')
+fiber = require('fiber')
+local clock = require('clock')
+local yaml = require('yaml')
+
+local DURATION = tonumber(os.getenv('BENCH_DURATION')) or 10
+local FIBERS = tonumber(os.getenv('BENCH_FIBERS')) or 50
+local BATCH_SIZE = 10
+local SELECT_LIMIT = 100
+
+local cfg, new_server = dofile('cluster.lua')
+
+shard.init(cfg)
+shard.wait_connection()
+shard:enable_resharding()
+
+local last_id = 0
+local last_operation = 0
+
+local function next_id()
+    last_id = last_id + 1
+    return last_id
+end
+
+local function next_operation()
+    last_operation = last_operation + 1
+    return tostring(last_operation)
+end
+
+local function random_id()
+    return math.random(last_id)
+end
+
+-- wait until the resharding workers of any storage pick up a space
+local function wait_resharding()
+    local deadline = clock.monotonic() + 60
+    while clock.monotonic() < deadline do
+        for _, node in ipairs(remote_resharding_state()) do
+            local status = node.data and node.data[1] and node.data[1][1]
+            if status and status.in_progress ~= '' then
+                return
+            end
+        end
+        fiber.sleep(0.1)
+    end
+    error('resharding has not started')
+end
+
+local function percentile(latencies, p)
+    if #latencies == 0 then
+        return 0
+    end
+    return latencies[math.max(1, math.ceil(#latencies * p))]
+end
+
+-- run fun(fiber_no) in FIBERS fibers for DURATION seconds, fun returns
+-- the same values as shard requests: result or nil, error
+local function run(name, fun)
+    local latencies = {}
+    local errors = 0
+    local done = fiber.channel(FIBERS)
+    local start = clock.monotonic()
+    local deadline = start + DURATION
+    for f = 1, FIBERS do
+        fiber.create(function()
+            while clock.monotonic() < deadline do
+                local request_start = clock.monotonic()
+                local ok, _, err = pcall(fun, f)
+                if ok and err == nil then
+                    table.insert(latencies, clock.monotonic() - request_start)
+                else
+                    errors = errors + 1
+                end
+            end
+            done:put(true)
+        end)
+    end
+    for _ = 1, FIBERS do
+        done:get()
+    end
+    local elapsed = clock.monotonic() - start
+    table.sort(latencies)
+    print(string.format('%-16s %10.0f %10.3f %10.3f %10.3f %8d', name,
+                        #latencies / elapsed,
+                        percentile(latencies, 0.5) * 1000,
+                        percentile(latencies, 0.99) * 1000,
+                        percentile(latencies, 0.999) * 1000, errors))
+end
+
+local scenarios = {
+    { 'insert', function()
+        return shard.demo:insert{next_id(), math.random(1000), 'payload'}
+    end },
+    { 'select', function()
+        return shard.demo:select{random_id()}
+    end },
+    { 'replace', function()
+        return shard.demo:replace{random_id(), math.random(1000), 'payload'}
+    end },
+    { 'mr_select', function()
+        return shard.demo:mr_select(shard.shards, 0,
+            {iterator = 'GE', limit = SELECT_LIMIT}, {random_id()})
+    end },
+    { 'secondary_select', function()
+        return shard.demo:secondary_select(1, {limit = SELECT_LIMIT},
+            {math.random(1000)})
+    end },
+    { 'q_select', function()
+        return shard.demo:q_select(0, {random_id()},
+            {iterator = 'GE', limit = SELECT_LIMIT})
+    end },
+    { 'q_insert', function()
+        return shard.demo:q_insert(next_operation(),
+            {next_id(), math.random(1000), 'payload'})
+    end },
+    { 'q_begin/q_end', function()
+        local batch = shard.q_begin()
+        for _ = 1, BATCH_SIZE do
+            batch.demo:q_insert(next_operation(),
+                {next_id(), math.random(1000), 'payload'})
+        end
+        return batch:q_end()
+    end },
+}
+
+print(string.format('%-16s %10s %10s %10s %10s %8s', 'scenario', 'ops/sec',
+                    'p50, ms', 'p99, ms', 'p999, ms', 'errors'))
+for _, scenario in ipairs(scenarios) do
+    run(scenario[1], scenario[2])
+end
+
+if new_server ~= nil then
+    remote_append({{uri = new_server, zone = tostring(#cfg.servers)}})
+    local ok, err = start_resharding()
+    if not ok then
+        error(err)
+    end
+    wait_resharding()
+    run('reshard select', function()
+        return shard.demo:select{random_id()}
+    end)
+    run('reshard replace', function()
+        return shard.demo:replace{random_id(), math.random(1000), 'payload'}
+    end)
+    print(yaml.encode(remote_resharding_state()))
+end
+
+os.exit(0)
@@ -0,0 +1,12 @@
+#!/usr/bin/env tarantool
+-- Storage of the benchmark cluster, see bench.sh
+-- Usage: tarantool storage.lua <port> <server uri>...
+shard = require('shard')
+fiber = require('fiber')
+
+local cfg = dofile('cluster.lua')
+
+fiber.create(function()
+    shard.init(cfg)
+    shard:enable_resharding()
+end)
@@ -2,6 +2,7 @@ local fiber = require('fiber')
 local log = require('log')
 local msgpack = require('msgpack')
 local remote = require('net.box')
+local uuid = require('uuid')
 local yaml = require('yaml')
 
 -- default values
@@ -9,8 +10,29 @@ local HEARTBEAT_TIMEOUT = 500
 local DEAD_TIMEOUT = 5
 local INFINITY_MIN = -1
 local RECONNECT_AFTER = msgpack.NULL
+-- number of heartbeat changes kept for delta exchange
+local GOSSIP_LOG_SIZE = 10000
+-- phi accrual failure detector settings
+local PHI_WINDOW = 100
+local PHI_MIN_SAMPLES = 3
+local PHI_MIN_STDDEV = 0.1
+local PHI_CHECK_INTERVAL = 0.1
+local PHI_PROBE_INTERVAL = 0.5
+local PHI_MAX_INTERVAL = 5
+-- fast startup settings
+local CONNECT_TIMEOUT = 1
+local CONNECT_BACKOFF_MIN = 0.01
+local CONNECT_BACKOFF_MAX = 1
 
 local pool_table = {}
+local pool_objects = {}
+
+--- 1.6 and 1.7 netbox compat
+local compat = string.sub(require('tarantool').version, 1,3)
+local nb_call = 'call'
+if compat ~= '1.6' then
+    nb_call = 'call_16'
+end
 
 -- intentionally made global. this needs to be redone
 -- heartbeat monitoring function
@@ -19,6 +41,18 @@ function heartbeat(pool_id)
     return pool_table[pool_id]
 end
 
+-- gossip heartbeat function, returns heartbeat entries changed after
+-- version 'since' of the run 'run' as {version, {seen_by, uri, try, ts, ...},
+-- run}, all entries are returned if the run has changed
+function heartbeat_delta(pool_id, since, run)
+    log.debug('gossip to %s since %d', pool_id, since)
+    local pool = pool_objects[pool_id]
+    if pool == nil then
+        return nil
+    end
+    return pool:heartbeat_changes(since, run)
+end
+
 -- default callbacks
 
 -- callbacks for usage in case of a failover
@@ -53,6 +87,16 @@ local function on_connected(self)
     log.info('connected to all servers')
 end
 
+-- called when phi of the server exceeds the threshold
+local function on_suspect(self, srv, phi)
+    log.warn("%s is suspected (phi %.2f)", srv.uri, phi)
+end
+
+-- called when a suspected server answers heartbeat again
+local function on_unsuspect(self, srv)
+    log.info("%s is not suspected anymore", srv.uri)
+end
+
 -- on server disconnect
 local function on_disconnect_one(self, srv)
     log.warn("kill %s by dead timeout", srv.uri)
@@ -121,7 +165,7 @@ local function server_is_ok(self, srv, include_dead)
     if include_dead then
         return true
     end
-    return srv:is_ok()
+    return srv:is_ok() and not srv.suspected
 end
 
 local function merge_zones(self)
@@ -178,7 +222,7 @@ local function monitor_fiber(self)
         i = i + 1
         local server = self:get_any_active_server(nil, true)
 
-        if not server:is_ok() and not server:is_dead() then
+        if (not server:is_ok() or server.suspected) and not server:is_dead() then
             local uri = server.uri
             log.debug("monitoring: %s", uri)
             local dead = true
@@ -199,6 +243,96 @@ local function monitor_fiber(self)
     end
 end
 
+--[[
+Each change of a heartbeat entry gets a new version from a local counter.
+heartbeat_log maps version -> {seen_by, uri} for the last GOSSIP_LOG_SIZE
+changes and heartbeat_versions keeps the latest version of each entry, so
+a peer receives only entries changed since its previous exchange.
+An entry changes when its try changes: a refresh of ts alone is not
+versioned, the current ts is sent along with the next change.
+Versions restart from 0 when the node restarts, so each run of a pool has
+its own heartbeat_run id and a peer that saw another run gets all entries.
+]]--
+local function touch_heartbeat(self, seen_by, uri)
+    local version = self.heartbeat_version + 1
+    self.heartbeat_version = version
+    self.heartbeat_log[version] = { seen_by, uri }
+    local versions = self.heartbeat_versions[seen_by]
+    if versions == nil then
+        versions = {}
+        self.heartbeat_versions[seen_by] = versions
+    end
+    versions[uri] = version
+
+    -- forget old changes
+    local start = version - GOSSIP_LOG_SIZE
+    if start >= self.heartbeat_log_start then
+        self.heartbeat_log[start] = nil
+        self.heartbeat_log_start = start + 1
+    end
+end
+
+-- version the entry if its try differs from the previous one or the entry
+-- has no version yet
+local function update_entry(self, seen_by, uri, try)
+    local versions = self.heartbeat_versions[seen_by]
+    if versions == nil or versions[uri] == nil or
+            self.heartbeat_state[seen_by][uri].try ~= try then
+        self:touch_heartbeat(seen_by, uri)
+    end
+end
+
+local function append_entry(self, entries, seen_by, uri)
+    local data = self.heartbeat_state[seen_by][uri]
+    local n = #entries
+    entries[n + 1] = seen_by
+    entries[n + 2] = uri
+    entries[n + 3] = data.try
+    entries[n + 4] = data.ts
+end
+
+local function heartbeat_changes(self, since, run)
+    local entries = {}
+    -- peer has seen a previous run of this node or too old changes
+    if run ~= self.heartbeat_run or since > self.heartbeat_version or
+            since + 1 < self.heartbeat_log_start then
+        for seen_by, versions in pairs(self.heartbeat_versions) do
+            for uri, _ in pairs(versions) do
+                append_entry(self, entries, seen_by, uri)
+            end
+        end
+        return { self.heartbeat_version, entries, self.heartbeat_run }
+    end
+    for version = since + 1, self.heartbeat_version do
+        local change = self.heartbeat_log[version]
+        local seen_by, uri = change[1], change[2]
+        -- skip entries changed once again later
+        if self.heartbeat_versions[seen_by][uri] == version then
+            append_entry(self, entries, seen_by, uri)
+        end
+    end
+    return { self.heartbeat_version, entries, self.heartbeat_run }
+end
+
+-- merge delta received from a peer by fiber time, entries of servers
+-- unknown to this node are skipped as in merge_tables
+local function merge_delta(self, entries)
+    local merged = 0
+    for i = 1, #entries, 4 do
+        local seen_by, uri = entries[i], entries[i + 1]
+        local try, ts = entries[i + 2], entries[i + 3]
+        local opinions = self.heartbeat_state[seen_by]
+        if opinions ~= nil and opinions[uri] ~= nil and
+                ts > opinions[uri].ts then
+            local old_try = opinions[uri].try
+            opinions[uri] = { try = try, ts = ts }
+            self:update_entry(seen_by, uri, old_try)
+            merged = merged + 1
+        end
+    end
+    return merged
+end
+
 -- merge node response data with local table by fiber time
 local function merge_tables(self, response)
     if response == nil then
@@ -210,7 +344,9 @@ local function merge_tables(self, response)
             for uri, data in pairs(new_beat) do
                 if data.ts > old_beat[uri].ts then
                     log.debug('merged heartbeat for uri %s from %s', uri, seen_by_uri)
+                    local old_try = old_beat[uri].try
                     old_beat[uri] = data
+                    self:update_entry(seen_by_uri, uri, old_try)
                 end
             end
         end
@@ -232,10 +368,11 @@ end
 local function update_heartbeat(self, uri, response, status)
     -- local pool is represented via self_server
     -- for the remote pool (eg shards) each remote server represents itself
-    local opinion = self.heartbeat_state[uri]
+    local seen_by = uri
     if self.self_server then
-        opinion = self.heartbeat_state[self.self_server.uri]
+        seen_by = self.self_server.uri
     end
+    local opinion = self.heartbeat_state[seen_by]
 
     -- new nodes may be appended
     -- update table if we have recieved heartbeat from new node
@@ -254,6 +391,7 @@ local function update_heartbeat(self, uri, response, status)
         opinion = self.heartbeat_state[uri]
     end
 
+    local try = opinion[uri].try
     if not status then
         -- register that an error occured during heartbeat
         opinion[uri].try = opinion[uri].try + 1
@@ -263,10 +401,117 @@ local function update_heartbeat(self, uri, response, status)
         opinion[uri].try = 0
     end
     opinion[uri].ts = fiber.time()
+    self:update_entry(seen_by, uri, try)
     -- update local heartbeat table
     self:merge_tables(response)
 end
 
+--[[
+Phi accrual failure detector. Successful heartbeats and requests to a
+server are arrivals, a server without arrivals for PHI_PROBE_INTERVAL
+seconds is pinged by its own probe fiber. Inter-arrival times are sampled
+at most once per PHI_PROBE_INTERVAL and kept per server in a sliding
+window. Phi is a suspicion level based on the time since the last arrival
+and the normal distribution of the window.
+A gap longer than PHI_MAX_INTERVAL (the server was suspected, dead or
+disconnected) is not a sample, the window starts over.
+A server with phi above cfg.phi_threshold is suspected and excluded from
+routing at once, the dead verdict still requires all peers to agree.
+]]--
+local function record_arrival(self, srv)
+    if self.configuration.phi_threshold == nil then
+        return
+    end
+    local now = fiber.time()
+    local stat = srv.arrivals
+    if stat ~= nil and (srv.suspected or
+                        now - stat.last > PHI_MAX_INTERVAL) then
+        stat = nil
+    end
+    if stat == nil then
+        stat = { n = 0, pos = 0, sum = 0, sum2 = 0, window = {} }
+        srv.arrivals = stat
+    elseif now - stat.last < PHI_PROBE_INTERVAL then
+        return
+    else
+        local interval = now - stat.last
+        stat.pos = stat.pos % PHI_WINDOW + 1
+        local old = stat.window[stat.pos]
+        if old ~= nil then
+            stat.sum = stat.sum - old
+            stat.sum2 = stat.sum2 - old * old
+        else
+            stat.n = stat.n + 1
+        end
+        stat.window[stat.pos] = interval
+        stat.sum = stat.sum + interval
+        stat.sum2 = stat.sum2 + interval * interval
+    end
+    stat.last = now
+
+    if srv.suspected then
+        srv.suspected = false
+        self:on_unsuspect(srv)
+    end
+end
+
+local function get_phi(self, srv)
+    local stat = srv.arrivals
+    if stat == nil or stat.n < PHI_MIN_SAMPLES then
+        return 0
+    end
+    local mean = stat.sum / stat.n
+    local variance = math.max(stat.sum2 / stat.n - mean * mean, 0)
+    local stddev = math.max(math.sqrt(variance), PHI_MIN_STDDEV)
+    local t = fiber.time() - stat.last
+    -- logistic approximation of the normal CDF
+    local y = (t - mean) / stddev
+    local e = math.exp(-y * (1.5976 + 0.070566 * y * y))
+    if t > mean then
+        return -math.log10(e / (1 + e))
+    end
+    return -math.log10(1 - 1 / (1 + e))
+end
+
+local function probe_fiber(self, srv)
+    fiber.name("_" .. self.configuration.pool_name .. "_probe", { truncate = true })
+    while true do
+        -- a server with recent traffic is not pinged
+        local stat = srv.arrivals
+        local quiet = stat == nil or
+                      fiber.time() - stat.last >= PHI_PROBE_INTERVAL
+        if quiet and srv:is_ok() then
+            local conn = srv.conn:timeout(self.HEARTBEAT_TIMEOUT)
+            local ok, alive = pcall(conn.ping, conn)
+            if ok and alive then
+                self:record_arrival(srv)
+            end
+        end
+        fiber.sleep(PHI_PROBE_INTERVAL)
+    end
+end
+
+local function suspicion_fiber(self)
+    fiber.name("_" .. self.configuration.pool_name .. "_suspicion", { truncate = true })
+    local threshold = self.configuration.phi_threshold
+    while true do
+        for _, srv in ipairs(self:merge_zones()) do
+            -- appended servers get their probes here as well
+            if srv.probe_fiber == nil then
+                srv.probe_fiber = fiber.create(probe_fiber, self, srv)
+            end
+            if not srv.suspected and not srv:is_dead() then
+                local phi = self:get_phi(srv)
+                if phi > threshold then
+                    srv.suspected = true
+                    self:on_suspect(srv, phi)
+                end
+            end
+        end
+        fiber.sleep(PHI_CHECK_INTERVAL)
+    end
+end
+
 -- heartbeat worker
 local function heartbeat_fiber(self)
     fiber.name("_" .. self.configuration.pool_name .. "_heartbeat", { truncate = true })
@@ -278,7 +523,30 @@ local function heartbeat_fiber(self)
             local uri = server.uri
             log.debug("checking %s", uri)
 
-            if server:is_connected() then
+            if server:is_connected() and self.configuration.gossip then
+                -- get changed heartbeat entries from node
+                local response
+                local since = self.gossip_since[uri] or {}
+                local status, err_state = pcall(function()
+                    local conn = server.conn:timeout(self.HEARTBEAT_TIMEOUT)
+                    response = conn[nb_call](conn, 'heartbeat_delta',
+                        self.configuration.pool_name, since.version or 0,
+                        since.run)[1]
+                end)
+                status = status and response ~= nil and
+                         type(response[1]) == 'number'
+
+                self:update_heartbeat(uri, nil, status)
+                if status then
+                    self:record_arrival(server)
+                    self.gossip_since[uri] = {
+                        version = response[1],
+                        run = response[3],
+                    }
+                    local merged = self:merge_delta(response[2])
+                    log.debug("merged %d heartbeat entries from %s", merged, uri)
+                end
+            elseif server:is_connected() then
                 -- get heartbeat from node
                 local response
                 local status, err_state = pcall(function()
@@ -287,18 +555,24 @@ local function heartbeat_fiber(self)
                 end)
                 -- update local heartbeat table
                 self:update_heartbeat(uri, response, status)
+                if status then
+                    self:record_arrival(server)
+                end
                 log.debug("%s", yaml.encode(self.heartbeat_state))
             else
                 -- failed server's opinion marked useless
-                for _, opinion in pairs(self.heartbeat_state[server.uri]) do
+                for lserver, opinion in pairs(self.heartbeat_state[server.uri]) do
+                    local try = opinion.try
                     opinion.ts = fiber.time()
                     opinion.try = INFINITY_MIN
+                    self:update_entry(server.uri, lserver, try)
                 end
                 -- register failed attempt at heartbeat
                 if self.self_server then
                     local opinion = self.heartbeat_state[self.self_server.uri][server.uri]
                     opinion.ts = fiber.time()
                     opinion.try = opinion.try + 1
+                    self:touch_heartbeat(self.self_server.uri, server.uri)
                 end
             end
         end
@@ -343,6 +617,7 @@ local function fill_table(self)
         end
     end
     pool_table[self.configuration.pool_name] = self.heartbeat_state
+    pool_objects[self.configuration.pool_name] = self
 end
 
 local function get_heartbeat(self)
@@ -367,8 +642,69 @@ local server_state_methods = {
     is_ready = function(self)
         return self:is_ok() and self.state == 'is_dead_connected'
     end,
+    -- returns the connection with the least requests in flight, bulk
+    -- requests go to the dedicated connection if it is configured
+    acquire = function(self, bulk)
+        local best = self.conn
+        if bulk and self.bulk_conn ~= nil and self.bulk_conn:is_connected() then
+            best = self.bulk_conn
+        elseif self.conns ~= nil then
+            local min = math.huge
+            for _, conn in ipairs(self.conns) do
+                local n = self.inflight[conn] or 0
+                if n < min and conn:is_connected() then
+                    best, min = conn, n
+                end
+            end
+        end
+        if best ~= nil then
+            self.inflight[best] = (self.inflight[best] or 0) + 1
+        end
+        return best
+    end,
+    -- counters of closed connections are dropped once their requests
+    -- are released
+    release = function(self, conn)
+        if conn ~= nil then
+            local n = (self.inflight[conn] or 0) - 1
+            if n > 0 then
+                self.inflight[conn] = n
+            else
+                self.inflight[conn] = nil
+            end
+        end
+    end,
 }
 
+-- open additional connections to the server, the main one is srv.conn
+local function open_connections(self, srv)
+    for _, conn in ipairs(srv.conns or {}) do
+        if conn ~= srv.conn then
+            conn:close()
+        end
+    end
+    if srv.bulk_conn ~= nil then
+        srv.bulk_conn:close()
+        srv.bulk_conn = nil
+    end
+    -- requests in flight on the old connections are still released
+    srv.inflight = srv.inflight or {}
+
+    local opts = {
+        user = srv.login,
+        password = srv.password,
+        reconnect_after = self.RECONNECT_AFTER,
+        wait_connected = false
+    }
+    srv.conns = { srv.conn }
+    for i = 2, self.configuration.connections or 1 do
+        srv.conns[i] = remote:new(srv.uri, opts)
+    end
+    if self.configuration.bulk_connection then
+        srv.bulk_conn = remote:new(srv.uri, opts)
+    end
+end
+
 local function connect(self, id, server)
     -- filling server parameters
     local arbiter = server.arbiter or false
@@ -383,6 +719,7 @@ local function connect(self, id, server)
         login    = login,
         arbiter  = arbiter,
         password = pass,
+        inflight = {},
     }
     setmetatable(srv, { __index = server_state_methods })
 
@@ -392,12 +729,31 @@ local function connect(self, id, server)
     zone.list[zone.n] = srv
 
     log.info(' - %s - connecting...', server.uri)
+    local fast = self.configuration.fast_startup
+    local delay = CONNECT_BACKOFF_MIN
     while true do
         srv.state = 'connecting'
-        local conn = remote:new(uri, { reconnect_after = self.RECONNECT_AFTER })
-        if conn:ping() and conn.state == 'active' then
+        local conn, connected
+        if fast then
+            -- schema is fetched by net.box during the handshake
+            conn = remote:new(uri, {
+                reconnect_after = self.RECONNECT_AFTER,
+                wait_connected = false
+            })
+            connected = conn:wait_connected(CONNECT_TIMEOUT)
+        else
+            conn = remote:new(uri, { reconnect_after = self.RECONNECT_AFTER })
+            connected = conn:ping() and conn.state == 'active'
+        end
+        if connected then
             srv.conn = conn
-            local ok, uuid = pcall(conn.eval, conn, "return box.info.server.uuid")
+            -- peer uuid comes with the greeting, older net.box versions
+            -- don't expose it and need a request
+            local ok, uuid = true, conn.peer_uuid
+            if uuid == nil then
+                ok, uuid = pcall(conn.eval, conn,
+                                 "return box.info.server.uuid")
+            end
             if ok and uuid == box.info.server.uuid then
                 log.info("setting self_server to " .. server.uri)
                 self.self_server = srv
@@ -406,9 +762,47 @@ local function connect(self, id, server)
         end
         conn:close()
         self:on_connection_failure(srv)
-        fiber.sleep(math.random(1000)/1000)
+        if fast then
+            -- bounded exponential backoff with jitter
+            fiber.sleep(delay * (0.5 + math.random() / 2))
+            delay = math.min(delay * 2, CONNECT_BACKOFF_MAX)
+        else
+            fiber.sleep(math.random(1000)/1000)
+        end
     end
+    self:open_connections(srv)
     self:on_connected_one(srv)
+    if self.connected_cond ~= nil then
+        self.connected_cond:broadcast()
+    end
+end
+
+local function try_reconnect(self, server)
+    local conn = remote:new(server.uri, {
+        user = server.login,
+        password = server.password,
+        reconnect_after = self.RECONNECT_AFTER,
+        wait_connected = false
+    })
+    if conn:wait_connected(CONNECT_TIMEOUT) then
+        server.conn = conn
+        server.conn_error = ""
+        self:open_connections(server)
+        self:on_dead_connected(server)
+    else
+        server.conn_error = conn.error
+        conn:close()
+    end
+end
+
+-- try to reconnect to a dead server, the guardian retries it on any error
+local function reconnect_dead(self, server)
+    local ok, err = pcall(try_reconnect, self, server)
+    if not ok then
+        server.conn_error = tostring(err)
+        log.error("failed to reconnect to %s: %s", server.uri, err)
+    end
+    server.reconnecting = false
 end
 
 local function guardian_fiber(self)
@@ -416,7 +810,13 @@ local function guardian_fiber(self)
     while true do
         for _, zone in pairs(self.servers) do
             for _, server in pairs(zone.list) do
-                if server:is_dead() then
+                if server:is_dead() and self.configuration.fast_startup then
+                    -- reconnect to dead servers in parallel
+                    if not server.reconnecting then
+                        server.reconnecting = true
+                        fiber.create(reconnect_dead, self, server)
+                    end
+                elseif server:is_dead() then
                     local conn = remote:new(server.uri, {
                         user = server.login,
                         password = server.password,
@@ -425,6 +825,7 @@ local function guardian_fiber(self)
                     if conn:ping() and conn.state == 'active' then
                         server.conn = conn
                         server.conn_error = ""
+                        self:open_connections(server)
                         self:on_dead_connected(server)
                     else
                         server.conn_error = conn.error
@@ -446,6 +847,10 @@ local function init(self, cfg)
 
     self.servers_n = 0
     self.zones_n = 0
+    -- wait_connection() is woken up by connect() in fast startup mode
+    if cfg.fast_startup and fiber.cond ~= nil then
+        self.connected_cond = fiber.cond()
+    end
 
     log.info('establishing connection to cluster servers...')
     for id, server in pairs(cfg.servers) do
@@ -468,6 +873,9 @@ local function start_monitoring(self)
     self.heartbeat_fiber = fiber.create(heartbeat_fiber, self)
     self.guardian_fiber = fiber.create(guardian_fiber, self)
     self.monitor_fiber = fiber.create(monitor_fiber, self)
+    if self.configuration.phi_threshold ~= nil then
+        self.suspicion_fiber = fiber.create(suspicion_fiber, self)
+    end
 end
 
 local function len(self)
@@ -493,7 +901,11 @@ local function wait_connection(self)
             self:on_connected()
             return true
         end
-        fiber.sleep(0.1)
+        if self.connected_cond ~= nil then
+            self.connected_cond:wait(0.1)
+        else
+            fiber.sleep(0.1)
+        end
         log.verbose("Retry checking connections")
     end
 end
@@ -512,9 +924,16 @@ local pool_object_methods = {
     server_is_ok = server_is_ok,
     merge_zones = merge_zones,
     merge_tables = merge_tables,
+    merge_delta = merge_delta,
+    touch_heartbeat = touch_heartbeat,
+    update_entry = update_entry,
+    heartbeat_changes = heartbeat_changes,
+    record_arrival = record_arrival,
+    get_phi = get_phi,
     monitor_fail = monitor_fail,
     update_heartbeat = update_heartbeat,
     connect = connect,
+    open_connections = open_connections,
     fill_table = fill_table,
     enable_operations = enable_operations,
 
@@ -543,7 +962,14 @@ local function new()
         zones_n = 0,
         self_server = nil,
         heartbeat_state = {},
+        heartbeat_version = 0,
+        heartbeat_run = uuid.str(),
+        heartbeat_versions = {},
+        heartbeat_log = {},
+        heartbeat_log_start = 1,
+        gossip_since = {},
         init_complete = false,
+        connected_cond = nil,
         epoch_counter = 1,
         configuration = {},
 
@@ -563,6 +989,8 @@ local function new()
         on_dead_disconnected = on_dead_disconnected,
         on_dead_connected = on_dead_connected,
         on_init = on_init,
+        on_suspect = on_suspect,
+        on_unsuspect = on_unsuspect,
         on_server_fail = on_server_fail,
         on_server_return = on_server_return
     }, {
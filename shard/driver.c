@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -58,6 +59,15 @@ struct merger {
 	struct key_def *key_def;
 	box_tuple_format_t *format;
 	int order;
+	/* Counters of the last merge, see merge_stat(). */
+	uint64_t bytes;
+	uint64_t tuples;
+	uint64_t comparisons;
+	/* Fields of output tuples, all fields if output_count is 0. */
+	uint32_t *output;
+	uint32_t output_count;
+	char *output_buf;
+	size_t output_capacity;
 };
 
 static bool
@@ -73,6 +83,7 @@ source_less(const heap_t *heap, const struct heap_node *a,
 	if (right->tuple == NULL)
 		return true;
 	struct merger *merger = container_of(heap, struct merger, heap);
+	++merger->comparisons;
 	return merger->order *
 	       box_tuple_compare(left->tuple, right->tuple, merger->key_def) < 0;
 }
@@ -82,7 +93,7 @@ source_less(const heap_t *heap, const struct heap_node *a,
 #include "heap.h"
 
 static inline void
-source_fetch(struct source *source, box_tuple_format_t *format)
+source_fetch(struct source *source, struct merger *merger)
 {
 	source->tuple = NULL;
 	if (ibuf_used(source->buf) == 0)
@@ -92,8 +103,9 @@ source_fetch(struct source *source, box_tuple_format_t *format)
 	mp_next(&tuple_end);
 	assert(tuple_end <= source->buf->wpos);
 	source->buf->rpos = (char *)tuple_end;
-	source->tuple = box_tuple_new(format, tuple_beg, tuple_end);
+	source->tuple = box_tuple_new(merger->format, tuple_beg, tuple_end);
 	box_tuple_ref(source->tuple);
+	++merger->tuples;
 }
 
 static void
@@ -111,21 +123,72 @@ free_sources(struct merger *merger)
 	merger_heap_create(&merger->heap);
 }
 
+/*
+ * Build output tuple data from the output fields of the tuple in
+ * the merger buffer, missing fields are nil.
+ */
+static const char *
+merger_project(struct merger *merger, box_tuple_t *tuple, const char **end)
+{
+	size_t size = mp_sizeof_array(merger->output_count);
+	for (uint32_t i = 0; i < merger->output_count; ++i) {
+		const char *field = box_tuple_field(tuple, merger->output[i]);
+		if (field == NULL) {
+			size += mp_sizeof_nil();
+			continue;
+		}
+		const char *field_end = field;
+		mp_next(&field_end);
+		size += field_end - field;
+	}
+	if (size > merger->output_capacity) {
+		char *buf = (char *)realloc(merger->output_buf, size);
+		if (buf == NULL)
+			return NULL;
+		merger->output_buf = buf;
+		merger->output_capacity = size;
+	}
+	char *pos = mp_encode_array(merger->output_buf, merger->output_count);
+	for (uint32_t i = 0; i < merger->output_count; ++i) {
+		const char *field = box_tuple_field(tuple, merger->output[i]);
+		if (field == NULL) {
+			pos = mp_encode_nil(pos);
+			continue;
+		}
+		const char *field_end = field;
+		mp_next(&field_end);
+		memcpy(pos, field, field_end - field);
+		pos += field_end - field;
+	}
+	*end = pos;
+	return merger->output_buf;
+}
+
+/*
+ * Sources are select responses {IPROTO_DATA: [tuple, ...]}, or call
+ * responses {IPROTO_DATA: [[tuple, ...]]} of a function returning one
+ * table of tuples if wrapped is true.
+ */
 static int
 lbox_merger_start(struct lua_State *L)
 {
 	struct merger **merger_ptr;
 	uint32_t cdata_type;
-	if (lua_gettop(L) != 3 || lua_istable(L, 2) != 1 ||
+	int top = lua_gettop(L);
+	if ((top != 3 && top != 4) || lua_istable(L, 2) != 1 ||
 	    lua_isnumber(L, 3) != 1 ||
 	    (merger_ptr = luaL_checkcdata(L, 1, &cdata_type)) == NULL ||
 	    cdata_type != merger_type_id) {
 		return luaL_error(L, "Bad params, use: start(merger, {buffers}, "
-				  "order)");
+				  "order[, wrapped])");
 	}
+	bool wrapped = top == 4 && lua_toboolean(L, 4);
 	struct merger *merger = *merger_ptr;
 	merger->order =	lua_tointeger(L, 3) >= 0? 1: -1;
 	free_sources(merger);
+	merger->bytes = 0;
+	merger->tuples = 0;
+	merger->comparisons = 0;
 
 	merger->capacity = 8;
 	merger->sources = (struct source **)malloc(merger->capacity *
@@ -143,6 +206,7 @@ lbox_merger_start(struct lua_State *L)
 			break;
 		if (ibuf_used(buf) == 0)
 			continue;
+		merger->bytes += ibuf_used(buf);
 		if (merger->count == merger->capacity) {
 			merger->capacity *= 2;
 			struct source **new_sources;
@@ -169,10 +233,17 @@ lbox_merger_start(struct lua_State *L)
 			free_sources(merger);
 			return luaL_error(L, "Invalid merge source");
 		}
-		mp_decode_array((const char **)&buf->rpos);
+		uint32_t size = mp_decode_array((const char **)&buf->rpos);
+		if (wrapped) {
+			if (size != 1 || mp_typeof(*buf->rpos) != MP_ARRAY) {
+				free_sources(merger);
+				return luaL_error(L, "Invalid merge source");
+			}
+			mp_decode_array((const char **)&buf->rpos);
+		}
 		merger->sources[merger->count]->buf = buf;
 		merger->sources[merger->count]->tuple = NULL;
-		source_fetch(merger->sources[merger->count], merger->format);
+		source_fetch(merger->sources[merger->count], merger);
 		if (merger->sources[merger->count]->tuple != NULL)
 			merger_heap_insert(&merger->heap,
 					   &merger->sources[merger->count]->hnode);
@@ -199,9 +270,22 @@ lbox_merge_next(struct lua_State *L)
 		return 1;
 	}
 	struct source *source = container_of(hnode, struct source, hnode);
-	luaT_pushtuple(L, source->tuple);
+	if (merger->output_count == 0) {
+		luaT_pushtuple(L, source->tuple);
+	} else {
+		const char *data_end;
+		const char *data = merger_project(merger, source->tuple,
+						  &data_end);
+		if (data == NULL)
+			return luaL_error(L, "Can't alloc output buffer");
+		box_tuple_t *tuple = box_tuple_new(box_tuple_format_default(),
+						   data, data_end);
+		if (tuple == NULL)
+			return luaT_error(L);
+		luaT_pushtuple(L, tuple);
+	}
 	box_tuple_unref(source->tuple);
-	source_fetch(source, merger->format);
+	source_fetch(source, merger);
 	if (source->tuple == NULL)
 		merger_heap_delete(&merger->heap, hnode);
 	else
@@ -209,12 +293,36 @@ lbox_merge_next(struct lua_State *L)
 	return 1;
 }
 
+/*
+ * Read output field numbers of the merger from the table at index idx.
+ */
+static int
+merger_set_output(struct lua_State *L, struct merger *merger, int idx)
+{
+	uint32_t count = lua_objlen(L, idx);
+	if (count == 0)
+		return 0;
+	merger->output = (uint32_t *)malloc(sizeof(uint32_t) * count);
+	if (merger->output == NULL)
+		return -1;
+	for (uint32_t i = 0; i < count; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		merger->output[i] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	merger->output_count = count;
+	return 0;
+}
+
 static int
 lbox_merger_new(struct lua_State *L)
 {
-	if (lua_gettop(L) != 1 || lua_istable(L, 1) != 1) {
+	int top = lua_gettop(L);
+	if ((top != 1 && top != 2) || lua_istable(L, 1) != 1 ||
+	    (top == 2 && lua_istable(L, 2) != 1)) {
 		return luaL_error(L, "Bad params, use: new({"
-				  "{fieldno = fieldno, type = type}, ...}");
+				  "{fieldno = fieldno, type = type}, ...}"
+				  "[, {fieldno, ...}])");
 	}
 	uint16_t count = 0, capacity = 8;
 	uint32_t *fieldno = NULL;
@@ -288,6 +396,13 @@ lbox_merger_new(struct lua_State *L)
 		return luaL_error(L, "Can not create tuple format");
 	}
 
+	if (top == 2 && merger_set_output(L, merger, 2) != 0) {
+		box_tuple_format_unref(merger->format);
+		box_key_def_delete(merger->key_def);
+		free(merger);
+		return luaL_error(L, "Can not alloc output fields");
+	}
+
 	*(struct merger **)luaL_pushcdata(L, merger_type_id) = merger;
 	return 1;
 }
@@ -309,12 +424,33 @@ lbox_merger_cmp(lua_State *L)
 		return 1;
 	}
 	struct source *source = container_of(hnode, struct source, hnode);
+	++merger->comparisons;
 	lua_pushinteger(L, box_tuple_compare_with_key(source->tuple, key,
 						      merger->key_def) *
 			   merger->order);
 	return 1;
 }
 
+static int
+lbox_merger_stat(lua_State *L)
+{
+	struct merger **merger_ptr;
+	uint32_t cdata_type;
+	if (lua_gettop(L) != 1 ||
+	    (merger_ptr = luaL_checkcdata(L, 1, &cdata_type)) == NULL ||
+	    cdata_type != merger_type_id)
+		return luaL_error(L, "Bad params, use: stat(merger)");
+	struct merger *merger = *merger_ptr;
+	lua_createtable(L, 0, 3);
+	lua_pushnumber(L, merger->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, merger->tuples);
+	lua_setfield(L, -2, "tuples");
+	lua_pushnumber(L, merger->comparisons);
+	lua_setfield(L, -2, "comparisons");
+	return 1;
+}
+
 static int
 lbox_merger_del(lua_State *L)
 {
@@ -327,6 +463,8 @@ lbox_merger_del(lua_State *L)
 	free_sources(merger);
 	box_key_def_delete(merger->key_def);
 	box_tuple_format_unref(merger->format);
+	free(merger->output);
+	free(merger->output_buf);
 	free(merger);
 	return 0;
 }
@@ -343,6 +481,7 @@ luaopen_shard_driver(lua_State *L)
 		{"merge_start", lbox_merger_start},
 		{"merge_cmp", lbox_merger_cmp},
 		{"merge_next", lbox_merge_next},
+		{"merge_stat", lbox_merger_stat},
 		{"merge_del", lbox_merger_del},
 		{NULL, NULL}
 	};
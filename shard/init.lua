@@ -9,6 +9,7 @@ local lib_pool = require('shard.connpool')
 local ffi = require('ffi')
 local buffer = require('buffer')
 local mpffi = require'msgpackffi'
+local clock = require('clock')
 
 -- tuple array merge driver
 local driver = require('shard.driver')
@@ -25,7 +26,8 @@ local field_types = {
 }
 
 local merger = {}
-local function merge_new(key_parts)
+-- output is an optional list of zero-based field numbers of output tuples
+local function merge_new(key_parts, output)
     local parts = {}
     local part_no = 1
     for _, v in pairs(key_parts) do
@@ -42,17 +44,25 @@ local function merge_new(key_parts)
             error('Unknow field type: ' .. v.type)
         end
     end
-    local merger = driver.merge_new(parts)
+    local merger
+    if output ~= nil then
+        merger = driver.merge_new(parts, output)
+    else
+        merger = driver.merge_new(parts)
+    end
     ffi.gc(merger, driver.merge_del)
     return {
-        start = function (sources, order)
-            return driver.merge_start(merger, sources, order)
+        start = function (sources, order, wrapped)
+            return driver.merge_start(merger, sources, order, wrapped)
         end,
         cmp = function (key)
             return driver.merge_cmp(merger, key)
         end,
         next = function ()
             return driver.merge_next(merger)
+        end,
+        stat = function ()
+            return driver.merge_stat(merger)
         end
     }
 end
@@ -81,6 +91,7 @@ local RSD_FINISHED = 'FINISHED_SPACE'
 local RSD_HANDLED = 'HANDLED_SPACES'
 local RSD_STATE = 'RESHARDING'
 local RSD_FLAG = 'RESHARDING_STATE'
+local RSD_CURSOR = 'SCAN_CURSOR'
 local RESHARDING_RPS = 1000
 local TUPLES_PER_ITERATION = 1000
 local SELECT_LIMIT_DEFAULT = 1000
@@ -88,6 +99,7 @@ local SELECT_LIMIT_DEFAULT = 1000
 local connection_fiber = {
     fiber = nil,
     state = 'disconnected',
+    cond = nil,
 }
 
 local init_complete = false
@@ -166,6 +178,279 @@ local function make_error(errno, fmt, ...)
     return nil, { errno = errno, error = fmt }
 end
 
+--[[
+Router statistics: request counters, error counters and latency histograms
+for each operation, and for each operation per destination server and shard.
+Histogram bucket i counts requests with latency <= stats.bounds[i] seconds,
+the last bucket counts slower requests.
+]]--
+local stats = {
+    bounds = {
+        0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05,
+        0.1, 0.2, 0.5, 1, 2, 5
+    },
+}
+
+function stats.reset()
+    stats.operations = {}
+    stats.servers = {}
+    stats.shards = {}
+end
+stats.reset()
+
+function stats.observe(group, operation, latency, ok)
+    local hist = group[operation]
+    if hist == nil then
+        hist = { count = 0, errors = 0, time = 0, buckets = {} }
+        for i = 1, #stats.bounds + 1 do
+            hist.buckets[i] = 0
+        end
+        group[operation] = hist
+    end
+    hist.count = hist.count + 1
+    hist.time = hist.time + latency
+    if not ok then
+        hist.errors = hist.errors + 1
+    end
+    local i = 1
+    while i <= #stats.bounds and latency > stats.bounds[i] do
+        i = i + 1
+    end
+    hist.buckets[i] = hist.buckets[i] + 1
+end
+
+function stats.group(groups, key)
+    local group = groups[key]
+    if group == nil then
+        group = {}
+        groups[key] = group
+    end
+    return group
+end
+
+-- register a finished operation, start is a clock.monotonic() value
+function stats.operation(operation, start, ok)
+    stats.observe(stats.operations, operation, clock.monotonic() - start, ok)
+end
+
+-- register a finished request of the operation to the server, finish is
+-- the clock.monotonic() time of the response, now by default
+function stats.server(operation, server, start, ok, finish)
+    local latency = (finish or clock.monotonic()) - start
+    stats.observe(stats.group(stats.servers, server.uri), operation,
+                  latency, ok)
+    if server.shard_id ~= nil then
+        stats.observe(stats.group(stats.shards, server.shard_id), operation,
+                      latency, ok)
+    end
+end
+
+function stats.get()
+    return {
+        bounds = table.copy(stats.bounds),
+        operations = table.deepcopy(stats.operations),
+        servers = table.deepcopy(stats.servers),
+        shards = table.deepcopy(stats.shards),
+    }
+end
+
+--[[
+Fan-out query tracing, enabled by the trace_threshold option. A trace of
+mr_select, secondary_select, q_select or q_call keeps the time spent
+waiting for each shard and the bytes it sent, the merger counters and the
+time to build the result. Traces slower than the threshold are logged and
+kept in a log of the last traces.log_size ones.
+]]--
+local traces = {
+    log_size = 100,
+    log = {},
+}
+
+function traces.begin(operation, space)
+    if configuration.trace_threshold == nil then
+        return nil
+    end
+    return {
+        operation = operation,
+        space = space,
+        start = clock.monotonic(),
+        shards = {},
+    }
+end
+
+-- register a response of the server, start and finish (now by default)
+-- are clock.monotonic() values
+function traces.shard(trace, server, start, bytes, tuples, finish)
+    if trace == nil then
+        return
+    end
+    table.insert(trace.shards, {
+        uri = server.uri,
+        wait = (finish or clock.monotonic()) - start,
+        bytes = bytes,
+        tuples = tuples,
+    })
+end
+
+-- mark the beginning of the result build
+function traces.build(trace)
+    if trace == nil then
+        return
+    end
+    trace.build_start = clock.monotonic()
+end
+
+function traces.finish(trace, merge_obj)
+    if trace == nil then
+        return
+    end
+    local now = clock.monotonic()
+    trace.time = now - trace.start
+    if trace.build_start ~= nil then
+        trace.build = now - trace.build_start
+    end
+    trace.start = nil
+    trace.build_start = nil
+    if trace.time < configuration.trace_threshold then
+        return
+    end
+    if merge_obj ~= nil then
+        trace.merge = merge_obj.stat()
+    end
+    trace.ts = fiber.time()
+    log.warn('slow %s on %s: %s', trace.operation, trace.space,
+             json.encode(trace))
+    table.insert(traces.log, trace)
+    if #traces.log > traces.log_size then
+        table.remove(traces.log, 1)
+    end
+end
+
+function traces.get()
+    return table.deepcopy(traces.log)
+end
+
+--[[
+Router cache of point selects, enabled per space by the cache option:
+    cache = { space_name = { size = 1000, ttl = 1 }, ... }
+Results of select by a single-part key without options are cached by
+the key, evicted in LRU order and expire after ttl seconds (never by
+default). Writes through this router invalidate the key, all caches are
+dropped when the pool epoch or resharding state changes, and on
+reload_schema().
+A cache is a hash of entries and a circular LRU list with a sentinel
+head, head.next is the most recently used entry. The version is bumped
+by each invalidation, so a select that raced with a write doesn't put
+a stale result.
+]]--
+local caches = {
+    size_default = 1000,
+    spaces = {},
+    epoch = nil,
+    resharding = nil,
+}
+
+function caches.drop()
+    caches.spaces = {}
+end
+
+-- drop caches if topology or resharding state changed
+function caches.check(resharding)
+    local epoch = pool:get_epoch()
+    if epoch ~= caches.epoch or resharding ~= caches.resharding then
+        caches.drop()
+        caches.epoch = epoch
+        caches.resharding = resharding
+    end
+end
+
+function caches.space(space)
+    local space_cfg = configuration.cache and configuration.cache[space]
+    if space_cfg == nil then
+        return nil
+    end
+    local cache = caches.spaces[space]
+    if cache == nil then
+        local head = {}
+        head.next = head
+        head.prev = head
+        cache = {
+            size = space_cfg.size or caches.size_default,
+            ttl = space_cfg.ttl,
+            count = 0,
+            version = 0,
+            entries = {},
+            head = head,
+        }
+        caches.spaces[space] = cache
+    end
+    return cache
+end
+
+function caches.unlink(entry)
+    entry.prev.next = entry.next
+    entry.next.prev = entry.prev
+end
+
+function caches.push(cache, entry)
+    local head = cache.head
+    entry.prev = head
+    entry.next = head.next
+    head.next.prev = entry
+    head.next = entry
+end
+
+function caches.remove(cache, entry)
+    caches.unlink(entry)
+    cache.entries[entry.key] = nil
+    cache.count = cache.count - 1
+end
+
+function caches.get(cache, key)
+    local entry = cache.entries[key]
+    if entry == nil then
+        return nil
+    end
+    if entry.expires ~= nil and entry.expires < clock.monotonic() then
+        caches.remove(cache, entry)
+        return nil
+    end
+    caches.unlink(entry)
+    caches.push(cache, entry)
+    return entry.value
+end
+
+function caches.put(cache, key, value)
+    local entry = cache.entries[key]
+    if entry ~= nil then
+        caches.unlink(entry)
+    else
+        entry = { key = key }
+        cache.entries[key] = entry
+        cache.count = cache.count + 1
+    end
+    entry.value = value
+    if cache.ttl ~= nil then
+        entry.expires = clock.monotonic() + cache.ttl
+    end
+    caches.push(cache, entry)
+    if cache.count > cache.size then
+        caches.remove(cache, cache.head.prev)
+    end
+end
+
+function caches.invalidate(space, key)
+    local cache = caches.spaces[space]
+    if cache == nil then
+        return
+    end
+    cache.version = cache.version + 1
+    local entry = cache.entries[key]
+    if entry ~= nil then
+        caches.remove(cache, entry)
+    end
+end
+
 -- public API func that blocks invoked fiber until all shards are connected
 local function wait_for_shards_to_go_online(timeout, delay)
     local wait_start_time = fiber.time()
@@ -175,7 +460,12 @@ local function wait_for_shards_to_go_online(timeout, delay)
         if connection_fiber.state == 'connected' then
             return true
         end
-        fiber.sleep(delay * 2)
+        if connection_fiber.cond ~= nil then
+            -- woken up as soon as the shards are connected
+            connection_fiber.cond:wait(delay * 2)
+        else
+            fiber.sleep(delay * 2)
+        end
     end
     return false, "Timed out waiting for shards to go up"
 end
@@ -263,6 +553,59 @@ queue_mt = {
     }
 }
 
+--[[
+Call fun(server, ...) on all servers in parallel and wait for all of them.
+A call fails if fun raises an error or returns nil, err like make_error.
+Returns true if all calls succeeded and a list of per server results:
+    {uri = uri, ok = true, result = result}
+    {uri = uri, ok = false, error = err}
+]]--
+local broadcast = {}
+
+function broadcast.call(servers, fun, ...)
+    local args = {...}
+    local nodes = {}
+    local all_ok = true
+    if #servers == 0 then
+        return all_ok, nodes
+    end
+    local q = queue(function(task)
+        local ok, result, err = pcall(fun, task.server, unpack(args))
+        if ok and result == nil and err ~= nil then
+            ok, result = false, err
+        end
+        if ok then
+            nodes[task.i] = { uri = task.server.uri, ok = true,
+                              result = result }
+        elseif type(result) == 'table' and result.error ~= nil then
+            all_ok = false
+            nodes[task.i] = { uri = task.server.uri, ok = false,
+                              error = tostring(result.error),
+                              errno = result.errno }
+        else
+            all_ok = false
+            nodes[task.i] = { uri = task.server.uri, ok = false,
+                              error = tostring(result) }
+        end
+    end, #servers)
+    for i, server in ipairs(servers) do
+        q:put({ i = i, server = server })
+    end
+    q:join()
+    return all_ok, nodes
+end
+
+-- return error of the first failed node of broadcast results with all the
+-- node results in the nodes field
+function broadcast.error(nodes)
+    for _, node in ipairs(nodes) do
+        if not node.ok then
+            return nil, { errno = node.errno, error = node.error,
+                          nodes = nodes }
+        end
+    end
+end
+
 local function reshard_works(synchronizer_enabled)
     local mode
     if synchronizer_enabled then
@@ -402,6 +745,80 @@ local function drop_rsd_index(worker, space)
     unlock_transfer()
 end
 
+-- returns primary key of the tuple as a Lua table
+local function primary_key(space, tuple)
+    local key = {}
+    for _, part in pairs(space.index[0].parts) do
+        table.insert(key, tuple[part.fieldno])
+    end
+    return key
+end
+
+--[[
+Resharding progress of this node, per space. Counters are kept in memory
+and reset when a resharding starts:
+    scanned     - tuples read by the space iteration
+    queued      - tuples put into the worker space to be transferred
+    transferred - tuples moved to a new shard
+    bytes       - size of transferred tuples
+    errors      - failed transfers per destination server uri
+total is the size of the space when its resharding started.
+]]--
+local rsd_metrics = {
+    spaces = {},
+    -- rates are measured over the last window seconds in one second slots
+    window = 10,
+    -- resharding status of the cluster, collected by the synchronizer
+    cluster = {},
+}
+
+function rsd_metrics.reset()
+    rsd_metrics.spaces = {}
+end
+
+-- space size for ETA, vinyl spaces are not counted to avoid a full scan
+function rsd_metrics.space_len(space_name)
+    local space = box.space[space_name]
+    if space == nil or space.engine ~= 'memtx' then
+        return nil
+    end
+    return space:len()
+end
+
+function rsd_metrics.space(space_name)
+    local metrics = rsd_metrics.spaces[space_name]
+    if metrics == nil then
+        metrics = {
+            started = fiber.time(),
+            total = rsd_metrics.space_len(space_name),
+            scanned = 0,
+            queued = 0,
+            transferred = 0,
+            bytes = 0,
+            errors = {},
+            slots = {},
+        }
+        for i = 1, rsd_metrics.window do
+            metrics.slots[i] = { time = 0, scanned = 0, transferred = 0 }
+        end
+        rsd_metrics.spaces[space_name] = metrics
+    end
+    return metrics
+end
+
+-- adds n to a rate counter of the space and to its current slot
+function rsd_metrics.count(metrics, name, n)
+    metrics[name] = metrics[name] + n
+    local now = math.floor(fiber.time())
+    local slot = metrics.slots[now % rsd_metrics.window + 1]
+    if slot.time ~= now then
+        slot.time = now
+        slot.scanned = 0
+        slot.transferred = 0
+    end
+    slot[name] = slot[name] + n
+end
+
 local function process_tuple(space, tuple, worker, lookup)
     local shard_id = tuple[space.index[0].parts[1].fieldno]
     local old_sh = shard(shard_id, false, true)[1]
@@ -410,45 +827,113 @@ local function process_tuple(space, tuple, worker, lookup)
         return false
     end
 
-    local data = {}
-    for i, part in pairs(space.index[0].parts) do
-        table.insert(data, tuple[part.fieldno])
-    end
+    local data = primary_key(space, tuple)
     if lookup:get(data) == nil then
         table.insert(data, 1, STATE_NEW)
         worker:auto_increment(data)
+        local metrics = rsd_metrics.space(space.name)
+        metrics.queued = metrics.queued + 1
     end
     return true
 end
 
-local function tree_iter(space, worker, lookup, fun)
+--[[
+Scan cursor of each space is persisted in _shard as
+    {RSD_CURSOR:space_name, space_name, epoch, last_key}
+last_key is the primary key of the last processed tuple, it is an empty key
+when a pass begins, saved at each batch boundary and cleared when the pass
+is over. Each new pass over the space increments its epoch, epochs survive
+the end of resharding. If the node restarts in the middle of a pass the
+scan is resumed from last_key instead of starting from scratch.
+Only a TREE primary index has a stable order to resume from: hash order
+doesn't survive restart, recovery or rehash, so an interrupted pass over a
+HASH space is run again from the beginning.
+Tuples may be processed twice, it is safe because process_tuple checks the
+lookup index before queueing a tuple.
+]]--
+local scan = {}
+
+function scan.key(space_name)
+    return RSD_CURSOR .. ':' .. space_name
+end
+
+function scan.cursor(space_name)
+    local cursor = box.space._shard:get{scan.key(space_name)}
+    if cursor == nil or cursor[4] == nil then
+        return nil
+    end
+    return { epoch = cursor[3], key = cursor[4] }
+end
+
+function scan.begin(space_name)
+    local key = scan.key(space_name)
+    local cursor = box.space._shard:get{key}
+    local epoch = 1
+    if cursor ~= nil then
+        epoch = cursor[3] + 1
+    end
+    box.space._shard:replace{key, space_name, epoch, {}}
+    return { epoch = epoch, key = {} }
+end
+
+function scan.save(space, cursor, tuple)
+    cursor.key = primary_key(space, tuple)
+    box.space._shard:replace{scan.key(space.name), space.name,
+                             cursor.epoch, cursor.key}
+end
+
+function scan.finish(space, cursor)
+    cursor.key = nil
+    box.space._shard:replace{scan.key(space.name), space.name,
+                             cursor.epoch, msgpack.NULL}
+end
+
+-- clears positions of all spaces, epochs are kept
+function scan.reset()
+    local sh = box.space._shard
+    local prefix = scan.key('')
+    local cursors = {}
+    for _, cursor in sh:pairs(prefix, {iterator = 'GE'}) do
+        if string.sub(cursor[1], 1, #prefix) ~= prefix then
+            break
+        end
+        table.insert(cursors, cursor)
+    end
+    for _, cursor in ipairs(cursors) do
+        sh:replace{cursor[1], cursor[2], cursor[3], msgpack.NULL}
+    end
+    -- the single cursor row of the previous version
+    sh:delete{RSD_CURSOR}
+end
+
+local function tree_iter(space, worker, lookup, fun, cursor)
     local tuples = 0
+    local metrics = rsd_metrics.space(space.name)
     local params = {limit=RESHARDING_RPS, iterator = 'GT'}
-    local data = space.index[0]:select({}, params)
-    local last_id = {}
+    local data = space.index[0]:select(cursor.key, params)
 
     while #data > 0 do
-        last_id = data[#data]
         for _, tuple in pairs(data) do
             if fun(space, tuple, worker, lookup) then
                 tuples = tuples +1
             end
         end
+        rsd_metrics.count(metrics, 'scanned', #data)
 
-        local key = {}
-        for _, part in pairs(space.index[0].parts) do
-            table.insert(key, last_id[part.fieldno])
-        end
-        data = space.index[0]:select(key, params)
+        scan.save(space, cursor, data[#data])
+        data = space.index[0]:select(cursor.key, params)
         fiber.sleep(0.1)
     end
     return tuples
 end
 
+-- the scan position is not saved, see scan cursor
 local function hash_iter(space, worker, lookup, fun)
     local tuples, i = 0, 0
+    local metrics = rsd_metrics.space(space.name)
     for _, tuple in space:pairs() do
         i = i + 1
+        rsd_metrics.count(metrics, 'scanned', 1)
         if fun(space, tuple, worker, lookup) then
             tuples = tuples +1
         end
@@ -479,23 +964,38 @@ local function space_iteration(is_drop)
     end
     local worker = box.space[aux_space]
 
-    -- drop prev space
-    if is_drop then
-        drop_rsd_index(worker, space)
+    -- resume an interrupted pass, the worker space keeps its progress
+    local cursor = scan.cursor(space_name)
+    if cursor ~= nil then
+        log.info('Resume space iteration for space %s (epoch %d)',
+                 space_name, cursor.epoch)
+    else
+        -- drop prev space
+        if is_drop then
+            drop_rsd_index(worker, space)
+        end
+        cursor = scan.begin(space_name)
+        log.info('Space iteration for space %s (epoch %d)',
+                 space_name, cursor.epoch)
     end
     local lookup = worker.index.lookup
 
-    log.info('Space iteration for space %s', space_name)
     local tuples = 0
 
     if space.index[0].type == 'HASH' then
         tuples = hash_iter(space, worker, lookup, process_tuple)
     else
-        tuples = tree_iter(space, worker, lookup, process_tuple)
+        tuples = tree_iter(space, worker, lookup, process_tuple, cursor)
     end
 
-    log.info('Found %d tuples', tuples)
+    local metrics = rsd_metrics.space(space_name)
+    log.info('Found %d tuples (scanned %d, queued %d in total)', tuples,
+             metrics.scanned, metrics.queued)
+    -- a finished pass must not be resumed after restart
+    box.begin()
+    scan.finish(space, cursor)
     box.space._shard:replace{RSD_FINISHED, space_name}
+    box.commit()
     return true
 end
 
@@ -542,9 +1042,16 @@ local function transfer(self, space, worker, data, force)
         if not tuple then
             goto continue
         end
+        local metrics = rsd_metrics.space(space.name)
+        local destination
         local ok, err = pcall(function()
             local nodes = shard(tuple[1])
-            self:single_call(space.name, nodes[1], 'replace', tuple)
+            destination = nodes[1].uri
+            local _, call_err = self:single_call(space.name, nodes[1],
+                                                 'replace', tuple)
+            if call_err ~= nil then
+                error(call_err.error, 0)
+            end
         end)
         if ok then
             box.begin()
@@ -553,7 +1060,11 @@ local function transfer(self, space, worker, data, force)
             end
             space:delete(index)
             box.commit()
+            rsd_metrics.count(metrics, 'transferred', 1)
+            metrics.bytes = metrics.bytes + tuple:bsize()
         else
+            destination = destination or 'unknown'
+            metrics.errors[destination] = (metrics.errors[destination] or 0) + 1
             log.info('Transfer error: %s', err)
         end
         ::continue::
@@ -637,6 +1148,7 @@ local function rsd_init()
     sh:replace{RSD_HANDLED, {}}
     sh:replace{RSD_CURRENT, ''}
     sh:replace{RSD_FINISHED, ''}
+    scan.reset()
     unlock_transfer()
 end
 
@@ -653,6 +1165,7 @@ local function rsd_finalize()
     sh:replace{RSD_HANDLED, {}}
     sh:replace{RSD_CURRENT, ''}
     sh:replace{RSD_FINISHED, ''}
+    scan.reset()
 end
 
 local function get_next_space(sh_state, cur_space)
@@ -715,8 +1228,14 @@ local function resharding_worker(self)
         rsd_warmup(self)
     end
 
+    local running = false
     while true do
         if reshard_works() then
+            -- a new resharding, start metrics from scratch
+            if not running then
+                rsd_metrics.reset()
+                running = true
+            end
             local cur_space = sh:get(RSD_CURRENT)[2]
             local finished = sh:get(RSD_FINISHED)[2]
 
@@ -732,7 +1251,12 @@ local function resharding_worker(self)
                 else
                     rsd_finalize()
                 end
+            elseif scan.cursor(cur_space) ~= nil then
+                -- scan of the current space was interrupted by restart
+                space_iteration(false)
             end
+        else
+            running = false
         end
 
         fiber.sleep(0.01)
@@ -743,10 +1267,49 @@ local function is_synchronizer_enabled()
     return box.space._shard:get{RSD_FLAG} ~= nil
 end
 
+function rsd_metrics.add(total, metrics)
+    for _, name in ipairs({'scanned', 'scanned_rps', 'queued',
+                           'transferred', 'transferred_rps', 'bytes'}) do
+        total[name] = (total[name] or 0) + (metrics[name] or 0)
+    end
+    total.errors = total.errors or {}
+    for uri, count in pairs(metrics.errors or {}) do
+        total.errors[uri] = (total.errors[uri] or 0) + count
+    end
+    -- storages reshard in parallel, the slowest one defines ETA
+    if metrics.eta ~= nil then
+        total.eta = math.max(total.eta or 0, metrics.eta)
+    end
+end
+
+function rsd_metrics.aggregate(cluster)
+    local result = {
+        status = false,
+        nodes = 0,
+        tasks = 0,
+        metrics = {},
+        ts = fiber.time(),
+    }
+    for _, node in pairs(cluster) do
+        if node.data and node.data[1] and node.data[1][1] then
+            local response = node.data[1][1]
+            result.nodes = result.nodes + 1
+            result.status = result.status or response.status
+            result.tasks = result.tasks + (response.tasks or 0)
+            for space_name, metrics in pairs(response.metrics or {}) do
+                result.metrics[space_name] = result.metrics[space_name] or {}
+                rsd_metrics.add(result.metrics[space_name], metrics)
+            end
+        end
+    end
+    return result
+end
+
 local function resharding_status_syncronizer()
     fiber.name('Resharding status synchronizer')
     while true do
         local cluster = _G.remote_resharding_state()
+        rsd_metrics.cluster = rsd_metrics.aggregate(cluster)
         local current_in_progress = box.space._shard:get{RSD_FLAG}[2]
         local in_progress = 0
         for _, node in pairs(cluster) do
@@ -798,6 +1361,61 @@ _G.remote_resharding_state = function()
     return result
 end
 
+-- rate of a counter over the last window seconds, the window is shorter
+-- while the space is processed for less than that
+function rsd_metrics.rate(metrics, name, now)
+    local first = math.floor(now) - rsd_metrics.window + 1
+    local count = 0
+    for _, slot in ipairs(metrics.slots) do
+        if slot.time >= first then
+            count = count + slot[name]
+        end
+    end
+    local elapsed = now - math.max(first, metrics.started)
+    if elapsed <= 0 then
+        return 0
+    end
+    return count / elapsed
+end
+
+--[[
+Per-space metrics with recent rates in tuples per second. ETA of the current
+space is estimated from the rest of the scan at the scan rate, and from
+the queued and expected to be queued tuples at the transfer rate.
+]]--
+function rsd_metrics.status(current, tasks)
+    local now = fiber.time()
+    local result = {}
+    for space_name, metrics in pairs(rsd_metrics.spaces) do
+        local item = {
+            scanned = metrics.scanned,
+            scanned_rps = rsd_metrics.rate(metrics, 'scanned', now),
+            queued = metrics.queued,
+            transferred = metrics.transferred,
+            transferred_rps = rsd_metrics.rate(metrics, 'transferred', now),
+            bytes = metrics.bytes,
+            errors = table.copy(metrics.errors),
+        }
+        local to_scan = math.max((metrics.total or 0) - metrics.scanned, 0)
+        -- a finished scan has no recent scan rate, only transfers are left
+        if space_name == current and metrics.total ~= nil and
+                metrics.scanned > 0 and item.transferred_rps > 0 and
+                (to_scan == 0 or item.scanned_rps > 0) then
+            local share = metrics.queued / metrics.scanned
+            item.eta = (tasks + to_scan * share) / item.transferred_rps
+            if to_scan > 0 then
+                item.eta = math.max(to_scan / item.scanned_rps, item.eta)
+            end
+        end
+        result[space_name] = item
+    end
+    return result
+end
+
+function rsd_metrics.cluster_status()
+    return table.deepcopy(rsd_metrics.cluster)
+end
+
 local function resharding_status()
     local status = box.space._shard:get{RSD_STATE}
     if status ~= nil then
@@ -813,7 +1431,8 @@ local function resharding_status()
         status=status,
         spaces=spaces,
         in_progress=current,
-        tasks=worker_len
+        tasks=worker_len,
+        metrics=rsd_metrics.status(current, worker_len)
     }
 end
 
@@ -897,6 +1516,7 @@ local function append_shard(servers)
         -- TODO: functionality with the arbiter should be deleted in a future
         if not server.arbiter then
             shards[shards_n + 1] = shards[shards_n + 1] or {}
+            zone.list[zone.n].shard_id = shards_n + 1
             table.insert(shards[shards_n + 1], zone.list[zone.n])
         end
     end
@@ -960,6 +1580,7 @@ local function shard_connect(s_obj)
         return false, msg
     end
     s_obj.conn = conn
+    pool:open_connections(s_obj)
     s_obj.state = 'connected'
     log.info("Succesfully joined shard %d with url '%s'", s_obj.id, s_obj.uri)
     return true
@@ -1116,6 +1737,28 @@ local function remote_rotate(shard_id)
     return cluster_operation("rotate_shard", shard_id)
 end
 
+-- executes the function under the passed space using the passed connection
+-- of the server
+local function conn_space_call(server, conn, space_name, fun, ...)
+    local result = nil
+    local status, reason = pcall(function(...)
+        local conn = conn:timeout(5 * REMOTE_TIMEOUT)
+        local space_obj = conn.space[space_name]
+        if space_obj == nil then
+            conn:reload_schema()
+            space_obj = conn.space[space_name]
+        end
+        result = fun(space_obj, ...)
+    end, ...)
+    if not status then
+        return make_error(reason.code, 'failed to execute operation on %s: %s',
+                          server.uri, reason)
+    end
+    -- the response spares a ping of the failure detector
+    pool:record_arrival(server)
+    return result
+end
+
 -- the function executes an function under the passed space on the remote server
 -- @space_name - name of the space in which an operation will be executed
 -- @server - server object, where server.conn is the connpool object
@@ -1124,7 +1767,6 @@ end
 -- @return a result of the function, be aware that this result may be a nil,
 -- or nil, error_object
 local function space_call(self, space_name, server, fun, ...)
-    local result = nil
     if server == nil or server.conn == nil then
         return make_error(nil, 'Connection to server was lost')
     end
@@ -1133,20 +1775,10 @@ local function space_call(self, space_name, server, fun, ...)
         return make_error(nil, 'Argument should be a function')
     end
 
-    local status, reason = pcall(function(...)
-        local conn = server.conn:timeout(5 * REMOTE_TIMEOUT)
-        local space_obj = conn.space[space_name]
-        if space_obj == nil then
-            conn:reload_schema()
-            space_obj = conn.space[space_name]
-        end
-        result = fun(space_obj, ...)
-    end, ...)
-    if not status then
-        return make_error(reason.code, 'failed to execute operation on %s: %s',
-                          server.uri, reason)
-    end
-    return result
+    local conn = server:acquire()
+    local result, err = conn_space_call(server, conn, space_name, fun, ...)
+    server:release(conn)
+    return result, err
 end
 
 -- the function executes a tarantool operation under the passed space
@@ -1212,65 +1844,222 @@ local function merge_sort(results, index_fields, limits, cut_index)
     return result
 end
 
-local function get_merger(space_obj, index_no)
+--[[
+Projection of mr_select and q_select by the fields option, a list of
+field numbers. Storages return the requested fields followed by missing
+fields of the sort key (see select_fields), the merger compares tuples
+by the key at these positions and outputs the requested fields only.
+net.box of 1.6 can't read call results to a buffer, so in compat mode
+whole tuples are fetched and only the merger output is projected.
+]]--
+local projection = {}
+
+function projection.new(index, fields)
+    local result = { output = {} }
+    if compat == '1.6' then
+        for i, fieldno in ipairs(fields) do
+            result.output[i] = fieldno - 1
+        end
+        result.parts = index.parts
+        return result
+    end
+    local fetch, position, parts = {}, {}, {}
+    for i, fieldno in ipairs(fields) do
+        fetch[i] = fieldno
+        position[fieldno] = position[fieldno] or i
+        result.output[i] = i - 1
+    end
+    for i, part in ipairs(index.parts) do
+        if position[part.fieldno] == nil then
+            table.insert(fetch, part.fieldno)
+            position[part.fieldno] = #fetch
+        end
+        parts[i] = { fieldno = position[part.fieldno], type = part.type }
+    end
+    result.fetch = fetch
+    result.parts = parts
+    return result
+end
+
+-- mergers are cached per space, sort index and projection; merge_obj.fetch
+-- holds fields to fetch from storages for a projected select
+local function get_merger(space_obj, index_no, fields)
     if merger[space_obj.name] == nil then
         merger[space_obj.name] = {}
     end
-    if merger[space_obj.name][index_no] == nil then
+    local name = index_no
+    if fields ~= nil then
+        name = index_no .. ':' .. table.concat(fields, ',')
+    end
+    if merger[space_obj.name][name] == nil then
         local index = space_obj.index[index_no]
-        merger[space_obj.name][index_no] = merge_new(index.parts)
+        local merge_obj
+        if fields == nil then
+            merge_obj = merge_new(index.parts)
+        else
+            local spec = projection.new(index, fields)
+            merge_obj = merge_new(spec.parts, spec.output)
+            merge_obj.fetch = spec.fetch
+        end
+        merger[space_obj.name][name] = merge_obj
     end
-    return merger[space_obj.name][index_no]
+    return merger[space_obj.name][name]
 end
 
-local function is_future(result)
-    return type(result) == 'table' and type(result.wait_result) == 'function'
+function projection.options(opts)
+    return {
+        iterator = opts.iterator,
+        limit = opts.limit,
+        offset = opts.offset,
+    }
 end
 
-local function mr_select(self, space_name, nodes, index_id, opts, key,
-        sort_index_id)
-    local results = {}
-    local sort_index_id = sort_index_id or index_id
-    local merge_obj = nil
+-- select of projected tuples, called by routers for projected mr_select and
+-- q_select, returns one table of tuples
+function projection.select(space, index_id, key, opts, fields)
+    local result = {}
+    local index = box.space[space].index[index_id]
+    for i, tuple in ipairs(index:select(key, opts)) do
+        local projected = {}
+        for j, fieldno in ipairs(fields) do
+            local value = tuple[fieldno]
+            if value == nil then
+                value = msgpack.NULL
+            end
+            projected[j] = value
+        end
+        result[i] = projected
+    end
+    return result
+end
+
+local function is_future(result)
+    return type(result) == 'table' and type(result.wait_result) == 'function'
+end
+
+-- select on the bulk connection of the server, the connection is returned
+-- to be released when the request is done; fetch is a list of fields of
+-- a projected select
+local function bulk_select(server, space_name, index_id, key, opts, fetch)
+    if server == nil or server.conn == nil then
+        return make_error(nil, 'Connection to server was lost')
+    end
+    local conn = server:acquire(true)
+    local result, err
+    if fetch ~= nil then
+        local ok, future = pcall(conn.call, conn, 'select_fields',
+            {space_name, index_id, key, projection.options(opts), fetch},
+            {buffer = opts.buffer, is_async = opts.is_async})
+        if ok then
+            result = future
+        else
+            result, err = make_error(future.code,
+                'failed to execute operation on %s: %s', server.uri, future)
+        end
+    else
+        result, err = conn_space_call(server, conn, space_name,
+                                      function(space_obj)
+            local index = space_obj.index[index_id]
+            return index:select(key, opts)
+        end)
+    end
+    if err then
+        server:release(conn)
+        return nil, err
+    end
+    return result, nil, conn
+end
+
+local function release_requests(requests)
+    for _, request in ipairs(requests) do
+        request.server:release(request.conn)
+    end
+end
+
+local function do_mr_select(self, operation, space_name, nodes, index_id,
+        opts, key, sort_index_id)
+    local results = {}
+    local sort_index_id = sort_index_id or index_id
+    local merge_obj = nil
     opts       = opts       or {}
     opts.limit = opts.limit or SELECT_LIMIT_DEFAULT
     opts.is_async = true
-    local futures = {}
+    local trace = traces.begin(operation, space_name)
+    local requests = {}
     for _, node in pairs(nodes) do
         local j = #node
         local srd = node[j]
         if merge_obj == nil then
-            merge_obj = get_merger(srd.conn.space[space_name], sort_index_id)
+            merge_obj = get_merger(srd.conn.space[space_name], sort_index_id,
+                                   opts.fields)
         end
         local buf = buffer.ibuf()
         opts.buffer = buf
-        local future, err = index_call(self, space_name, srd, 'select',
-                                       index_id, key, opts)
+        local request_start = clock.monotonic()
+        local future, err, conn = bulk_select(srd, space_name, index_id,
+                                              key, opts, merge_obj.fetch)
         if err then
+            stats.server(operation, srd, request_start, false)
+            release_requests(requests)
             return nil, err
         end
         while future == nil and j >= 0 do
             j = j - 1
             srd = node[j]
-            future, err = index_call(self, space_name, srd, 'select', index_id,
-                                     key, opts)
+            request_start = clock.monotonic()
+            future, err, conn = bulk_select(srd, space_name, index_id,
+                                            key, opts, merge_obj.fetch)
             if err then
+                stats.server(operation, srd, request_start, false)
+                release_requests(requests)
                 return nil, err
             end
         end
-        table.insert(futures, future)
+        local request = { future = future, server = srd, conn = conn,
+                          start = request_start }
+        -- in compat mode the select is done synchronously
+        if not is_future(future) then
+            request.finish = clock.monotonic()
+        end
+        table.insert(requests, request)
         table.insert(results, buf)
     end
 
-    -- wait for all requests to be done
-    for i = 1, #futures do
-        if is_future(futures[i]) then
-            local _, err = futures[i]:wait_result(5 * REMOTE_TIMEOUT)
-            if err then return nil, err end
+    -- a trace keeps the response time of each shard, so its shards are
+    -- awaited in parallel; otherwise responses are collected in order and
+    -- the time of a server is taken when its response is collected
+    if trace ~= nil and #requests > 0 then
+        local q = queue(function(request)
+            local _, err = request.future:wait_result(5 * REMOTE_TIMEOUT)
+            request.finish = clock.monotonic()
+            request.err = err
+        end, #requests)
+        for _, request in ipairs(requests) do
+            if request.finish == nil then
+                q:put(request)
+            end
+        end
+        q:join()
+    end
+    for i, request in ipairs(requests) do
+        if request.finish == nil then
+            local _, err = request.future:wait_result(5 * REMOTE_TIMEOUT)
+            request.finish = clock.monotonic()
+            request.err = err
+        end
+        stats.server(operation, request.server, request.start,
+                     request.err == nil, request.finish)
+        traces.shard(trace, request.server, request.start, results[i]:size(),
+                     nil, request.finish)
+        if request.err then
+            release_requests(requests)
+            return nil, request.err
         end
     end
+    release_requests(requests)
 
-    merge_obj.start(results, 1)
+    traces.build(trace)
+    merge_obj.start(results, 1, merge_obj.fetch ~= nil)
     local tuples = {}
     while #tuples < opts.limit do
         local tuple = merge_obj.next()
@@ -1279,32 +2068,61 @@ local function mr_select(self, space_name, nodes, index_id, opts, key,
         end
         table.insert(tuples, tuple)
     end
+    traces.finish(trace, merge_obj)
     return tuples
 end
 
-local function secondary_select(self, space_name, index_id, opts, key,
+local function mr_select(self, space_name, nodes, index_id, opts, key,
         sort_index_id)
-    return mr_select(self, space_name, shards, index_id, opts, key,
+    local start = clock.monotonic()
+    local result, err = do_mr_select(self, 'mr_select', space_name, nodes,
+        index_id, opts, key, sort_index_id)
+    stats.operation('mr_select', start, err == nil)
+    return result, err
+end
+
+local function secondary_select(self, space_name, index_id, opts, key,
         sort_index_id)
+    local start = clock.monotonic()
+    local result, err = do_mr_select(self, 'secondary_select', space_name,
+        shards, index_id, opts, key, sort_index_id)
+    stats.operation('secondary_select', start, err == nil)
+    return result, err
 end
 
--- load new schema and invalidate mergers (they hold index parts)
+-- load new schema of all nodes in parallel and invalidate mergers (they
+-- hold index parts), returns broadcast results, failed nodes are logged
 local function reload_schema()
+    local servers = {}
     for _, zone in ipairs(shards) do
         for _, node in ipairs(zone) do
-            node.conn:reload_schema()
+            table.insert(servers, node)
+        end
+    end
+    local ok, nodes = broadcast.call(servers, function(node)
+        node.conn:reload_schema()
+        return true
+    end)
+    for _, node in ipairs(nodes) do
+        if not node.ok then
+            log.warn('Failed to reload schema on %s: %s', node.uri, node.error)
         end
     end
 
     merger = {}
+    caches.drop()
+    return ok, nodes
 end
 
 local function direct_call(self, server, func_name, ...)
     local result = nil
+    local conn
     local status, reason = pcall(function(...)
-        local conn = server.conn:timeout(REMOTE_TIMEOUT)
+        conn = server:acquire()
+        local conn = conn:timeout(REMOTE_TIMEOUT)
         result = conn[nb_call](conn, func_name, ...)
     end, ...)
+    server:release(conn)
     if not status then
         log.error('failed to call %s on %s: %s', func_name, server.uri, reason)
         if not server:is_connected() then
@@ -1420,12 +2238,45 @@ local function transfer_wait(space, key)
     return true
 end
 
+-- select from the router cache, returns a cache to put the result to
+-- on a miss and its version
+function caches.request(space, operation, tuple_id, key, args)
+    caches.check(reshard_works())
+    local cache = caches.space(space)
+    if cache == nil then
+        return nil
+    end
+    if operation ~= 'select' then
+        caches.invalidate(space, tuple_id)
+        return nil
+    end
+    if args ~= nil or type(key) ~= 'table' or #key ~= 1 then
+        return nil
+    end
+    local result = caches.get(cache, tuple_id)
+    if result ~= nil then
+        return nil, table.copy(result)
+    end
+    return cache, nil, cache.version
+end
+
 -- function makes requests to a cluster
 -- @space - space name where a data is
 -- @operation - name of operation. It is the same as tarantool space operation names.
 -- @tuple_id - shard key
 -- @returns result of operation or nil, {error = error_test, errno = error_code}
 local function request(self, space, operation, tuple_id, ...)
+    local start = clock.monotonic()
+    local cache, cached, version
+    if configuration.cache ~= nil then
+        cache, cached, version = caches.request(space, operation, tuple_id,
+                                                 ...)
+        if cached ~= nil then
+            stats.operation('cached_select', start, true)
+            return cached
+        end
+    end
+
     local nodes = {}
     local err
     if operation == 'insert' or not reshard_works() then
@@ -1435,14 +2286,28 @@ local function request(self, space, operation, tuple_id, ...)
         nodes, err = lookup(self, space, tuple_id, ...)
     end
     if not nodes then
+        stats.operation(operation, start, false)
         return nil, err
     end
 
-    return single_call(self, space, nodes[1], operation, ...)
+    local call_start = clock.monotonic()
+    local result, err = single_call(self, space, nodes[1], operation, ...)
+    stats.operation(operation, start, err == nil)
+    stats.server(operation, nodes[1], call_start, err == nil)
+    if configuration.cache ~= nil then
+        if operation ~= 'select' then
+            caches.invalidate(space, tuple_id)
+        elseif cache ~= nil and err == nil and caches.spaces[space] == cache and
+                cache.version == version then
+            caches.put(cache, tuple_id, result)
+            result = table.copy(result)
+        end
+    end
+    return result, err
 end
 
-local function get_index_by_id(server, space_id, index_id)
-    local conn = server.conn
+local function get_index_by_id(server, space_id, index_id, conn)
+    local conn = conn or server.conn
     local space_obj = conn:timeout(REMOTE_TIMEOUT).space[space_id]
     if space_obj == nil then
         conn:reload_schema()
@@ -1452,14 +2317,28 @@ local function get_index_by_id(server, space_id, index_id)
 end
 
 local function broadcast_select(task)
-    local index = get_index_by_id(task.server, task.space_id, task.index_id)
-    local args = table.copy(task.args)
-    args.buffer = task.buffer
-    local status, result, err = pcall(index.select, index, task.key, args)
+    local start = clock.monotonic()
+    local conn = task.server:acquire(true)
+    local status, result, err = pcall(function()
+        if task.fetch ~= nil then
+            return conn:timeout(REMOTE_TIMEOUT):call('select_fields',
+                {task.space_id, task.index_id, task.key,
+                 projection.options(task.args), task.fetch},
+                {buffer = task.buffer})
+        end
+        local index = get_index_by_id(task.server, task.space_id,
+                                      task.index_id, conn)
+        local args = table.copy(task.args)
+        args.buffer = task.buffer
+        return index:select(task.key, args)
+    end)
+    task.server:release(conn)
+    stats.server('q_select', task.server, start, status and result ~= nil)
+    traces.shard(task.trace, task.server, start, task.buffer:size())
     if not status or result == nil then
         local err = string.format(
             'failed to execute operation on %s: %s',
-            server.uri, result or json.encode(err))
+            task.server.uri, result or json.encode(err))
         error(err)
     end
 end
@@ -1491,6 +2370,8 @@ local function q_select(self, space_id, index_id, key, args)
 
     -- handle secondary index case: make requests to all storages of a zone in
     -- parallel, wait for all, then merge results
+    local start = clock.monotonic()
+    local trace = traces.begin('q_select', space_id)
     local q = queue(broadcast_select, shards_n)
     local merge_obj = nil
     local results = {}
@@ -1498,7 +2379,8 @@ local function q_select(self, space_id, index_id, key, args)
         local srv = find_server_in_shard(shards[i], zone)
         if merge_obj == nil then
             local sort_index_id = args.sort_index_id or index_id
-            merge_obj = get_merger(srv.conn.space[space_id], sort_index_id)
+            merge_obj = get_merger(srv.conn.space[space_id], sort_index_id,
+                                   args.fields)
         end
         local buf = buffer.ibuf()
         table.insert(results, buf)
@@ -1509,14 +2391,21 @@ local function q_select(self, space_id, index_id, key, args)
             key = key,
             args = args,
             buffer = buf,
+            fetch = merge_obj.fetch,
+            trace = trace,
         }
         q:put(task)
     end
-    q:join()
+    local ok, err = pcall(q.join, q)
+    if not ok then
+        stats.operation('q_select', start, false)
+        error(err, 0)
+    end
 
     -- merge results from storages
     local limit = args.limit or SELECT_LIMIT_DEFAULT
-    merge_obj.start(results, 1)
+    traces.build(trace)
+    merge_obj.start(results, 1, merge_obj.fetch ~= nil)
     local tuples = {}
     while #tuples < limit do
         local tuple = merge_obj.next()
@@ -1525,31 +2414,103 @@ local function q_select(self, space_id, index_id, key, args)
         end
         table.insert(tuples, tuple)
     end
+    stats.operation('q_select', start, true)
+    traces.finish(trace, merge_obj)
     return tuples
 end
 
 local function broadcast_call(task)
-    local conn = task.server.conn:timeout(REMOTE_TIMEOUT)
-    local tuples = conn[nb_call](conn, task.proc, unpack(task.args))
+    local start = clock.monotonic()
+    local bulk_conn = task.server:acquire(true)
+    local conn = bulk_conn:timeout(REMOTE_TIMEOUT)
+    local ok, tuples = pcall(conn[nb_call], conn, task.proc, unpack(task.args))
+    task.server:release(bulk_conn)
+    stats.server('q_call', task.server, start, ok)
+    if not ok then
+        error(tuples)
+    end
+    traces.shard(task.trace, task.server, start, nil, #tuples)
     for _, v in ipairs(tuples) do
         table.insert(task.result, v)
     end
 end
 
 local function q_call(proc, args)
-        local q = queue(broadcast_call, shards_n)
+    local start = clock.monotonic()
+    local trace = traces.begin('q_call', proc)
+    local q = queue(broadcast_call, shards_n)
     local tuples = {}
     local zone = math.floor(math.random() * redundancy) + 1
     for i = 1, shards_n do
         local srv = find_server_in_shard(shards[i], zone)
         local task = { server = srv, proc = proc, args = args,
-                      result = tuples }
+                      result = tuples, trace = trace }
         q:put(task)
     end
-    q:join()
+    local ok, err = pcall(q.join, q)
+    stats.operation('q_call', start, ok)
+    if not ok then
+        error(err, 0)
+    end
+    traces.finish(trace)
     return tuples
 end
 
+--[[
+Queued operations are encoded as {space_id, op_code, msgpack(args)}:
+the operation name is replaced with a numeric code and arguments are
+encoded once on the router and decoded with a single call on a storage.
+Operations without a code are stored as {space_id, name, {args...}}.
+Storages of older versions execute only the named format, so a router
+encodes operations only with cfg.q_coded_operations; enable it when all
+nodes of the cluster are upgraded.
+]]--
+local operation_codec = {
+    codes = {
+        insert = 1,
+        replace = 2,
+        update = 3,
+        delete = 4,
+    },
+}
+
+operation_codec.dispatch = {
+    [operation_codec.codes.insert] = function(space, args)
+        return space:insert(args[1])
+    end,
+    [operation_codec.codes.replace] = function(space, args)
+        return space:replace(args[1])
+    end,
+    [operation_codec.codes.update] = function(space, args)
+        return space:update(args[1], args[2])
+    end,
+    [operation_codec.codes.delete] = function(space, args)
+        return space:delete(args[1])
+    end,
+}
+
+function operation_codec.encode(space_id, operation, args)
+    local code = operation_codec.codes[operation]
+    if code == nil or not configuration.q_coded_operations then
+        return { space_id; operation; args; }
+    end
+    return { space_id; code; msgpack.encode(args); }
+end
+
+-- apply batch of queued operations, must be called inside a transaction
+function operation_codec.apply_batch(batch)
+    for _, operation in ipairs(batch) do
+        local space = box.space[operation[1]]
+        local func = operation_codec.dispatch[operation[2]]
+        if func ~= nil then
+            func(space, (msgpack.decode(operation[3])))
+        else
+            -- operation is called by name
+            space[operation[2]](space, unpack(operation[3]))
+        end
+    end
+end
+
 -- execute operation, call from remote node
 local function execute_operation(operation_id)
     log.debug('EXEC_OP')
@@ -1558,57 +2519,195 @@ local function execute_operation(operation_id)
     local tuple = box.space._shard_operations:update(
         operation_id, {{'=', 2, STATE_INPROGRESS}}
     )
-    local batch = tuple[3]
+    operation_codec.apply_batch(tuple[3])
+    box.space._shard_operations:update(
+        operation_id, {{'=', 2, STATE_HANDLED}, {'=', 4, fiber.time()}}
+    )
+    box.commit()
+end
 
-    local result
+--[[
+Group commit of single call operations. Each call of push_execute_operation
+enqueues its batch and waits, a commit fiber applies all pending batches in
+one transaction (and one WAL write). Batches are isolated from each other
+by savepoints, so a failed batch does not abort the rest of the group.
+]]--
+local group_commit = {
+    pending = {},
+    fiber = nil,
+}
 
-    for _, operation in ipairs(batch) do
-        local space = operation[1]
-        local func_name = operation[2]
-        local args = operation[3]
-        local self = box.space[space]
-        result = self[func_name](self, unpack(args))
+-- register and apply the operation in the current transaction
+-- the operation id keeps the call idempotent
+function group_commit.execute_one(operation_id, batch)
+    local operations = box.space._shard_operations
+    local tuple = operations:get(operation_id)
+    if tuple == nil then
+        operations:insert{operation_id, STATE_HANDLED, batch, fiber.time()}
+        operation_codec.apply_batch(batch)
+    elseif tuple[2] ~= STATE_HANDLED then
+        -- pushed by the two-phase protocol but not executed yet
+        operations:update(
+            operation_id, {{'=', 2, STATE_HANDLED}, {'=', 4, fiber.time()}}
+        )
+        operation_codec.apply_batch(tuple[3])
+    end
+end
+
+-- apply all batches of the group in one transaction, sets ok and err of
+-- each request
+function group_commit.commit(pending)
+    box.begin()
+    for _, req in ipairs(pending) do
+        local sp = box.savepoint()
+        req.ok, req.err = pcall(group_commit.execute_one, req.id, req.batch)
+        if not req.ok then
+            box.rollback_to_savepoint(sp)
+        end
     end
-    box.space._shard_operations:update(operation_id, {{'=', 2, STATE_HANDLED}})
     box.commit()
 end
 
+-- each request of the group gets an answer, even if the worker fails
+function group_commit.worker()
+    fiber.name('_shard_group_commit')
+    while #group_commit.pending > 0 do
+        -- let concurrent requests join the group
+        local ok, err = pcall(fiber.sleep, 0)
+        local pending = group_commit.pending
+        group_commit.pending = {}
+        if ok then
+            ok, err = pcall(group_commit.commit, pending)
+            if not ok then
+                pcall(box.rollback)
+            end
+        end
+        if not ok then
+            for _, req in ipairs(pending) do
+                req.ok, req.err = false, err
+            end
+        end
+        log.debug('GROUP_COMMIT %d', #pending)
+        for _, req in ipairs(pending) do
+            req.ch:put(true, 0)
+        end
+    end
+    group_commit.fiber = nil
+end
+
+-- push and execute operation in one call, call from remote node
+local function push_execute_operation(operation_id, batch)
+    log.debug('PUSH_EXEC_OP')
+    local req = {
+        id = tostring(operation_id),
+        batch = batch,
+        ch = fiber.channel(1),
+    }
+    table.insert(group_commit.pending, req)
+    if group_commit.fiber == nil then
+        group_commit.fiber = fiber.create(group_commit.worker)
+    end
+    -- the request stays in the group after the timeout and may still be
+    -- committed: the router gets an error for an operation that can be
+    -- applied, check_operation tells the outcome
+    if req.ch:get(REMOTE_TIMEOUT) == nil then
+        error(string.format('group commit of operation %s timed out', req.id))
+    end
+    if not req.ok then
+        error(req.err)
+    end
+    return true
+end
+
 -- process operation in queue
 local function push_operation(task)
     local server = task.server
     local tuple = task.tuple
     log.debug('PUSH_OP')
-    server.conn.space._shard_operations:insert(tuple,{timeout = REMOTE_TIMEOUT})
+    local start = clock.monotonic()
+    local conn = server:acquire()
+    local ok, err = pcall(function()
+        conn.space._shard_operations:insert(tuple, {timeout = REMOTE_TIMEOUT})
+    end)
+    server:release(conn)
+    stats.server(task.operation, server, start, ok)
+    if not ok then
+        error(err)
+    end
 end
 
 local function ack_operation(task)
     log.debug('ACK_OP')
     local server = task.server
     local operation_id = task.id
-    local conn = server.conn
-    conn[nb_call](
+    local conn = server:acquire()
+    local ok, err = pcall(conn[nb_call],
         conn, 'execute_operation', operation_id, {timeout = REMOTE_TIMEOUT}
     )
+    server:release(conn)
+    if not ok then
+        error(err)
+    end
+end
+
+-- push and execute operation with a single request
+local function push_ack_operation(task)
+    log.debug('PUSH_ACK_OP')
+    local start = clock.monotonic()
+    local tuple = task.tuple
+    local server_conn = task.server:acquire()
+    local conn = server_conn:timeout(REMOTE_TIMEOUT)
+    local ok, err = pcall(conn[nb_call], conn, 'push_execute_operation',
+                          tuple[1], tuple[3])
+    task.server:release(server_conn)
+    stats.server(task.operation, task.server, start, ok)
+    if not ok then
+        error(err)
+    end
+end
+
+local function operation_queue()
+    if configuration.q_single_call then
+        return queue(push_ack_operation, redundancy)
+    end
+    return queue(push_operation, redundancy)
 end
 
 local function push_queue(obj)
-    for server, data in pairs(obj.batch) do
-        local tuple = {
-            obj.batch_operation_id;
-            STATE_NEW;
-            data;
-        }
-        local task = {tuple = tuple, server = server}
-        obj.q:put(task)
+    local start = clock.monotonic()
+    local ok, err = pcall(function()
+        for server, data in pairs(obj.batch) do
+            local tuple = {
+                obj.batch_operation_id;
+                STATE_NEW;
+                data;
+                fiber.time();
+            }
+            local task = {tuple = tuple, server = server,
+                          operation = obj.operation}
+            obj.q:put(task)
+        end
+        obj.q:join()
+        if not configuration.q_single_call then
+            -- all shards ready - start workers
+            obj.q = queue(ack_operation, redundancy)
+            for server, _ in pairs(obj.batch) do
+                obj.q:put({id=obj.batch_operation_id, server=server})
+            end
+            -- fix for memory leaks
+            obj.q:join()
+        end
+    end)
+    stats.operation(obj.operation, start, ok)
+    for _, key in ipairs(obj.cache_keys or {}) do
+        caches.invalidate(key[1], key[2])
     end
-    obj.q:join()
-    -- all shards ready - start workers
-    obj.q = queue(ack_operation, redundancy)
-    for server, _ in pairs(obj.batch) do
-        obj.q:put({id=obj.batch_operation_id, server=server})
+    if obj.cache_keys ~= nil then
+        obj.cache_keys = {}
+    end
+    if not ok then
+        error(err, 0)
     end
-    -- fix for memory leaks
-    obj.q:join()
 
     obj.batch = {}
     obj.batch_mode = false
@@ -1635,11 +2734,18 @@ local function queue_request(self, space, operation, operation_id, tuple_id, ...
         batch = {}
     end
 
+    local data = operation_codec.encode(box.space[space].id, operation, {...})
+    -- cached key is invalidated before and after the operation is pushed
+    local cache_keys
+    if configuration.cache ~= nil then
+        caches.invalidate(space, tuple_id)
+        cache_keys = batch_mode and self.cache_keys or {}
+        table.insert(cache_keys, {space, tuple_id})
+    end
     for _, server in ipairs(shard(tuple_id)) do
         if batch[server] == nil then
             batch[server] = {}
         end
-        local data = { box.space[space].id; operation; {...}; }
         batch[server][#batch[server] + 1] = data
 
         -- insert into first server and break if we use replication
@@ -1649,9 +2755,11 @@ local function queue_request(self, space, operation, operation_id, tuple_id, ...
     end
     if not batch_mode then
         local obj = {
-            q = queue(push_operation, redundancy),
+            q = operation_queue(),
             batch_operation_id = tostring(operation_id),
             batch = batch,
+            operation = 'q_' .. operation,
+            cache_keys = cache_keys,
         }
         push_queue(obj)
     end
@@ -1659,7 +2767,11 @@ end
 
 local function find_operation(id)
     log.debug('FIND_OP')
-    return box.space._shard_operations:get(id)[2]
+    local tuple = box.space._shard_operations:get(id)
+    if tuple == nil then
+        return nil
+    end
+    return tuple[2]
 end
 
 local function check_operation(self, space, operation_id, tuple_id)
@@ -1703,32 +2815,248 @@ local function check_operation(self, space, operation_id, tuple_id)
     return false
 end
 
-local function next_id(space)
-    local server_id = pool.self_server.id
-    local s = box.space[space]
-    if s == nil then
-        box.error(box.error.NO_SUCH_SPACE, tostring(space))
+local function find_operations(ids)
+    log.debug('FIND_OPS')
+    local operations = box.space._shard_operations
+    local result = {}
+    for i, id in ipairs(ids) do
+        local tuple = operations:get(id)
+        result[i] = tuple ~= nil and tuple[2] or msgpack.NULL
     end
-    if s.index[0].parts[1].type == 'STR' then
-        return uuid.str()
+    return result
+end
+
+-- fetch states of operations from one server
+local function fetch_operations(task)
+    task.ok = pcall(function()
+        local conn = task.server.conn:timeout(REMOTE_TIMEOUT)
+        local states = conn[nb_call](conn, 'find_operations', task.ids)[1]
+        for i, id in ipairs(task.ids) do
+            task.states[id] = states[i]
+        end
+    end)
+end
+
+-- bulk version of check_operation
+-- @operations - array of {operation_id, tuple_id}
+-- @returns table operation_id -> true/false
+local function check_operations(self, space, operations)
+    -- group operation ids by servers
+    local servers = {}
+    local op_servers = {}
+    for _, op in ipairs(operations) do
+        local operation_id = tostring(op[1])
+        local nodes = shard(op[2]) or {}
+        op_servers[operation_id] = nodes
+        for _, server in ipairs(nodes) do
+            servers[server] = servers[server] or {}
+            table.insert(servers[server], operation_id)
+        end
     end
-    local key = s.name .. '_max_id'
+
+    -- ask each server once, retry failed servers only for up to 5 seconds,
+    -- operations of servers that are still unreachable are not found
+    local states = {}
+    local delay = 0.001
+    local deadline = fiber.time() + 5
+    while true do
+        local tasks = {}
+        for server, ids in pairs(servers) do
+            table.insert(tasks, { server = server, ids = ids, states = {} })
+        end
+        if #tasks == 0 then
+            break
+        end
+        local q = queue(fetch_operations, #tasks)
+        for _, task in ipairs(tasks) do
+            q:put(task)
+        end
+        q:join()
+
+        servers = {}
+        for _, task in ipairs(tasks) do
+            if task.ok then
+                states[task.server] = task.states
+            else
+                servers[task.server] = task.ids
+            end
+        end
+        if next(servers) == nil or fiber.time() + delay > deadline then
+            break
+        end
+        log.debug('FAIL')
+        fiber.sleep(delay)
+        delay = math.min(delay * 2, 1)
+    end
+
+    -- operation is queued if it is found on all its servers
+    local result = {}
+    local acks = {}
+    for operation_id, nodes in pairs(op_servers) do
+        local found = #nodes > 0
+        local in_progress = false
+        for _, server in ipairs(nodes) do
+            local state = states[server] and states[server][operation_id]
+            if state == nil then
+                found = false
+                break
+            end
+            if state == STATE_INPROGRESS then
+                in_progress = true
+            end
+        end
+        result[operation_id] = found
+        if found and in_progress then
+            for _, server in ipairs(nodes) do
+                table.insert(acks, { id = operation_id, server = server })
+            end
+        end
+    end
+
+    if #acks > 0 then
+        local q = queue(ack_operation, math.min(#acks, shards_n * redundancy))
+        for _, task in ipairs(acks) do
+            q:put(task)
+        end
+        q:join()
+    end
+    return result
+end
+
+--[[
+Handled operations are kept in _shard_operations only for check_operation.
+The collector deletes them when they are older than cfg.operations_ttl
+seconds or when there are more than cfg.operations_max of them (the oldest
+go first). Deletes are made in small transactions with yields in between.
+Operations pushed by routers without the time field are treated as the
+oldest ones. The collector is idle on a read-only node.
+operations_max bounds the size of the whole space, unhandled operations
+are never deleted. The handled operations index has a nullable part, so
+the collector needs Tarantool 1.10 or newer.
+]]--
+local operations_gc = {
+    batch = 100,
+    interval = 1,
+}
+
+function operations_gc.supported()
+    local major, minor = string.match(require('tarantool').version,
+                                      '^(%d+)%.(%d+)')
+    return tonumber(major) > 1 or tonumber(minor) >= 10
+end
+
+function operations_gc.delete(tuples)
+    box.begin()
+    for _, tuple in ipairs(tuples) do
+        box.space._shard_operations:delete(tuple[1])
+    end
+    box.commit()
+    fiber.sleep(0)
+end
+
+function operations_gc.collect(ttl, max_count)
+    local index = box.space._shard_operations.index.handled
+    if index == nil then
+        error('collection of operations requires Tarantool 1.10 or newer')
+    end
+    local deadline = ttl and fiber.time() - ttl or -1
+    local excess = 0
+    if max_count ~= nil then
+        excess = box.space._shard_operations:len() - max_count
+    end
+
+    local deleted = 0
+    while true do
+        local tuples = {}
+        local data = index:select(
+            {STATE_HANDLED}, {iterator = 'GE', limit = operations_gc.batch}
+        )
+        for _, tuple in ipairs(data) do
+            if tuple[2] ~= STATE_HANDLED then
+                break
+            end
+            local ts = tuple[4] or 0
+            if ts >= deadline and deleted + #tuples >= excess then
+                break
+            end
+            table.insert(tuples, tuple)
+        end
+        if #tuples == 0 then
+            break
+        end
+        operations_gc.delete(tuples)
+        deleted = deleted + #tuples
+    end
+    if deleted > 0 then
+        log.verbose('Collected %d handled operations', deleted)
+    end
+    return deleted
+end
+
+function operations_gc.worker(ttl, max_count)
+    fiber.name('_shard_operations_gc')
+    while true do
+        if not box.cfg.read_only then
+            local ok, err = pcall(operations_gc.collect, ttl, max_count)
+            if not ok then
+                log.error('Operations collector error: %s', err)
+            end
+        end
+        fiber.sleep(operations_gc.interval)
+    end
+end
+
+--[[
+Auto increment ids of a space are interleaved: the server takes each
+pool:len()-th id starting from its own id. Ids are reserved in blocks of
+id_blocks.size, the last reserved id is persisted in _schema with one write
+per block and ids of the block are handed out from memory. Unused ids of
+the block are skipped after restart.
+]]--
+local id_blocks = {
+    size = 100,
+    blocks = {},
+}
+
+function id_blocks.reserve(space, key, step, server_id)
     local _schema = box.space._schema
     local tuple = _schema:get{key}
-    local next_id
+    local first
     if tuple == nil then
-        tuple = box.space[space].index[0]:max()
+        tuple = space.index[0]:max()
         if tuple == nil then
-            next_id = server_id
+            first = server_id
         else
-            next_id = math.floor((tuple[1] + 2 * shards_n + 1) / shards_n)
-            next_id = next_id * shards_n + server_id
+            first = math.floor((tuple[1] + 2 * shards_n + 1) / shards_n)
+            first = first * shards_n + server_id
         end
-        _schema:insert{key, next_id}
     else
-        next_id = tuple[2] + pool:len()
-        tuple = _schema:update({key}, {{'=', 2, next_id}})
+        first = tuple[2] + step
     end
+    local last = first + (id_blocks.size - 1) * step
+    _schema:replace{key, last}
+    return { next = first, last = last, step = step }
+end
+
+local function next_id(space)
+    local server_id = pool.self_server.id
+    local s = box.space[space]
+    if s == nil then
+        box.error(box.error.NO_SUCH_SPACE, tostring(space))
+    end
+    if s.index[0].parts[1].type == 'STR' then
+        return uuid.str()
+    end
+    local key = s.name .. '_max_id'
+    local step = pool:len()
+    local block = id_blocks.blocks[key]
+    -- the block is reserved again when the cluster size changes
+    if block == nil or block.step ~= step or block.next > block.last then
+        block = id_blocks.reserve(s, key, step, server_id)
+        id_blocks.blocks[key] = block
+    end
+    local next_id = block.next
+    block.next = block.next + step
     return next_id
 end
 
@@ -1770,45 +3098,69 @@ local function truncate_local_space(space)
     return ok, err
 end
 
+function broadcast.masters()
+    local masters = {}
+    for _, node_set in ipairs(shards) do
+        table.insert(masters, node_set[#node_set])
+    end
+    return masters
+end
+
+-- mark the space handled by the resharding on the master
+local function truncate_handled(master, space)
+    local ok, rv = pcall(master.conn.space._shard.get,
+                         master.conn.space._shard,
+                         {RSD_HANDLED})
+    if not ok then
+        return make_error(rv.code, 'Request to server: %s failed (%s)',
+                          master.uri, rv)
+    end
+    local handled_spaces = rv[2]
+    if not contains(handled_spaces, space) then
+        table.insert(handled_spaces, space)
+        local ok, err = pcall(master.conn.space._shard.replace,
+                                master.conn.space._shard,
+                                {RSD_HANDLED, handled_spaces})
+        if not ok then
+            return make_error(err.code, 'Request to server: %s failed (%s)',
+                              master.uri, err)
+        end
+    end
+    return true
+end
+
+local function truncate_master(master, space)
+    local execute_string = string.format("return require('shard').truncate_local_space('%s')", space)
+    local pcall_ok, ok, res = pcall(master.conn.eval, master.conn, execute_string)
+    if not pcall_ok or not ok then
+        local err = ok
+        if not ok then
+            err = res
+        end
+        return make_error(err.code, 'Error occured during a truncate of ' ..
+                                    'the space %s on the server: %s. (%s)',
+                          space, master.uri, err)
+    end
+    return true
+end
+
+-- truncate the space on masters of all shards in parallel, on failure
+-- the error of the first failed master is returned, err.nodes has results
+-- of all masters
 local function truncate(self, space)
+    local masters = broadcast.masters()
     local synchronizer_enabled = is_synchronizer_enabled()
     if reshard_works(synchronizer_enabled) then
-        for _, node_set in ipairs(shards) do
-            local master = node_set[#node_set]
-            local ok, rv = pcall(master.conn.space._shard.get,
-                                 master.conn.space._shard,
-                                 {RSD_HANDLED})
-            if not ok then
-                return make_error(rv.code, 'Request to server: %s failed (%s)',
-                                  master.uri, rv)
-            end
-            local handled_spaces = rv[2]
-            if not contains(handled_spaces, space) then
-                table.insert(handled_spaces, space)
-                local ok, err = pcall(master.conn.space._shard.replace,
-                                        master.conn.space._shard,
-                                        {RSD_HANDLED, handled_spaces})
-                if not ok then
-                    return make_error(err.code, 'Request to server: %s failed (%s)',
-                                      master.uri, err)
-                end
-            end
+        local ok, nodes = broadcast.call(masters, truncate_handled, space)
+        if not ok then
+            return broadcast.error(nodes)
         end
     end
 
-    for _, node_set in ipairs(shards) do
-        local master = node_set[#node_set]
-        local execute_string = string.format("return require('shard').truncate_local_space('%s')", space)
-        local pcall_ok, ok, res = pcall(master.conn.eval, master.conn, execute_string)
-        if not pcall_ok or not ok then
-            local err = ok
-            if not ok then
-                err = res
-            end
-            return make_error(err.code, 'Error occured during a truncate of ' ..
-                                        'the space %s on the server: %s. (%s)',
-                              space, master.uri, err)
-        end
+    local ok, nodes = broadcast.call(masters, truncate_master, space)
+    caches.spaces[space] = nil
+    if not ok then
+        return broadcast.error(nodes)
     end
 
     return true
@@ -1849,7 +3201,9 @@ end
 local function q_begin()
     local batch_obj = {
         batch = {},
-        q = queue(push_operation, redundancy),
+        q = operation_queue(),
+        operation = 'q_end',
+        cache_keys = {},
         batch_mode = true,
         q_insert = q_insert,
         q_auto_increment = q_auto_increment,
@@ -1976,10 +3330,25 @@ local function shard_init_v03()
     box.space.sh_worker_vinyl:drop()
 end
 
+local function shard_init_v04()
+    -- operations are stamped with creation (handle) time, it is
+    -- used to collect handled operations; old operations and operations
+    -- of routers that don't stamp them yet have no time
+    box.space._shard_operations:create_index('handled', {
+        type   = 'tree',
+        parts  = { { 2, 'number' }, { 4, 'number', is_nullable = true } },
+        unique = false
+    })
+end
+
 local function init_create_spaces(cfg)
     box.once('shard_init_v01', shard_init_v01)
     box.once('shard_init_v02', shard_init_v02)
     box.once('shard_init_v03', shard_init_v03)
+    -- postponed on older versions until the node is upgraded
+    if operations_gc.supported() then
+        box.once('shard_init_v04', shard_init_v04)
+    end
     configuration = cfg
 end
 
@@ -2020,6 +3389,7 @@ local function shard_mapping(zones)
             if srv ~= nil then
                 log.info("Adding %s to shard %d", srv.uri, shards_n)
                 srv.zone_name = name
+                srv.shard_id = shards_n
                 table.insert(shards[shards_n], srv)
                 if #shards[shards_n] == redundancy then
                     shards_n = shards_n + 1
@@ -2079,6 +3449,10 @@ local function enable_operations()
 
     -- set helpers
     shard_obj.check_operation = check_operation
+    shard_obj.check_operations = check_operations
+    shard_obj.stats = stats.get
+    shard_obj.stats_reset = stats.reset
+    shard_obj.traces = traces.get
     shard_obj.get_heartbeat = get_heartbeat
 
     -- enable easy spaces access
@@ -2129,6 +3503,9 @@ local function enable_operations()
                 check_operation = function(this, ...)
                     return self.check_operation(self, space, ...)
                 end,
+                check_operations = function(this, ...)
+                    return self.check_operations(self, space, ...)
+                end,
                 single_call = function(this, ...)
                     return self.single_call(self, space, ...)
                 end,
@@ -2181,6 +3558,9 @@ local function establish_connections_in_pool()
         pool:start_monitoring()
     end
     connection_fiber.state = 'connected'
+    if connection_fiber.cond ~= nil then
+        connection_fiber.cond:broadcast()
+    end
     return true
 end
 
@@ -2195,8 +3575,20 @@ local function init(cfg, callback)
     pool.RECONNECT_AFTER = shard_obj.RECONNECT_AFTER
 
     pool:init(cfg)
+    if cfg.fast_startup and fiber.cond ~= nil then
+        connection_fiber.cond = fiber.cond()
+    end
     connection_fiber.fiber = fiber.create(establish_connections_in_pool)
 
+    if (cfg.operations_ttl ~= nil or cfg.operations_max ~= nil) and
+            not operations_gc.supported() then
+        log.error('operations_ttl and operations_max require Tarantool 1.10')
+    elseif cfg.operations_ttl ~= nil or cfg.operations_max ~= nil then
+        shard_obj.operations_gc_fiber = fiber.create(
+            operations_gc.worker, cfg.operations_ttl, cfg.operations_max
+        )
+    end
+
     return true
 end
 
@@ -2229,18 +3621,22 @@ _G.join_shard        = join_shard
 _G.unjoin_shard      = unjoin_shard
 _G.rotate_shard      = rotate_shard
 _G.resharding_status = resharding_status
+_G.cluster_resharding_status = rsd_metrics.cluster_status
 _G.remote_append     = remote_append
 _G.remote_join       = remote_join
 _G.remote_unjoin     = remote_unjoin
 _G.remote_rotate     = remote_rotate
 
 _G.find_operation    = find_operation
+_G.find_operations   = find_operations
 _G.transfer_wait     = transfer_wait
 
 _G.cluster_operation = cluster_operation
 _G.execute_operation = execute_operation
+_G.push_execute_operation = push_execute_operation
 _G.force_transfer    = force_transfer
 _G.merge_sort        = merge_sort
+_G.select_fields     = projection.select
 _G.shard_status      = shard_status
 _G.get_server_list   = get_server_list
 _G.synchronize_shards_object = synchronize_shards_object
@@ -2307,6 +3703,7 @@ shard_obj = {
     is_table_filled = is_table_filled,
     wait_table_fill = wait_table_fill,
     queue = queue,
+    broadcast = broadcast.call,
     init = init,
     shard = shard,
     pool = pool,
@@ -2314,6 +3711,8 @@ shard_obj = {
     check_shard = check_shard,
     resharding_worker_fiber = msgpack.NULL, -- initial value
     transfer_worker_fiber = msgpack.NULL, -- initial value
+    operations_gc_fiber = msgpack.NULL, -- initial value
+    collect_operations = operations_gc.collect,
     enable_resharding = enable_resharding,
     disable_resharding = disable_resharding
 }
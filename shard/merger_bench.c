@@ -0,0 +1,305 @@
+/*
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmark of heap.h in the shape of the merge loop of driver.c.
+ *
+ * K sources hold select responses ({IPROTO_DATA: [tuple, ...]}) with
+ * tuples sorted by the first field, the merger walks them with heap.h
+ * the same way lbox_merge_next() does. box_tuple_* functions exist only
+ * inside tarantool, so this is not the driver.c code: source_less() and
+ * source_fetch() below are simplified copies which compare raw msgpack
+ * keys with memcmp() and create no tuples. Only the heap and the walk
+ * over the buffers are measured, tuple creation and box_tuple_compare()
+ * costs of the real merger are not.
+ *
+ * Usage: merger_bench [rows [repeat]]
+ * rows is the total number of tuples in all sources, by default
+ * 10000 and 1000000 are measured.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ibuf.h"
+#include "msgpuck.h"
+
+#define HEAP_FORWARD_DECLARATION
+#include "heap.h"
+
+#define IPROTO_DATA 0x30
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+enum key_type {
+	KEY_UNSIGNED,
+	KEY_STRING,
+	key_type_MAX
+};
+
+static const char *key_type_strs[] = { "unsigned", "string" };
+
+static const char payload[] = "payload-payload-";
+
+struct source {
+	struct heap_node hnode;
+	struct ibuf *buf;
+	/* Current tuple and its first field. */
+	const char *tuple;
+	const char *key;
+};
+
+struct merger {
+	heap_t heap;
+	enum key_type type;
+	uint64_t tuples;
+	uint64_t comparisons;
+};
+
+static int
+key_compare(enum key_type type, const char *a, const char *b)
+{
+	if (type == KEY_UNSIGNED) {
+		uint64_t left = mp_decode_uint(&a);
+		uint64_t right = mp_decode_uint(&b);
+		return left < right ? -1 : left > right;
+	}
+	uint32_t left_len, right_len;
+	const char *left = mp_decode_str(&a, &left_len);
+	const char *right = mp_decode_str(&b, &right_len);
+	int rc = memcmp(left, right,
+			left_len < right_len ? left_len : right_len);
+	if (rc != 0)
+		return rc;
+	return left_len < right_len ? -1 : left_len > right_len;
+}
+
+static bool
+source_less(const heap_t *heap, const struct heap_node *a,
+	    const struct heap_node *b)
+{
+	struct source *left = container_of(a, struct source, hnode);
+	struct source *right = container_of(b, struct source, hnode);
+	struct merger *merger = container_of(heap, struct merger, heap);
+	++merger->comparisons;
+	return key_compare(merger->type, left->key, right->key) < 0;
+}
+
+#define HEAP_NAME merger_heap
+#define HEAP_LESS source_less
+#include "heap.h"
+
+static inline void
+source_fetch(struct source *source, struct merger *merger)
+{
+	source->tuple = NULL;
+	if (ibuf_used(source->buf) == 0)
+		return;
+	const char *tuple_end = source->buf->rpos;
+	source->tuple = tuple_end;
+	mp_next(&tuple_end);
+	assert(tuple_end <= source->buf->wpos);
+	source->buf->rpos = (char *)tuple_end;
+	const char *key = source->tuple;
+	mp_decode_array(&key);
+	source->key = key;
+	++merger->tuples;
+}
+
+static char *
+encode_key(char *pos, enum key_type type, uint64_t key)
+{
+	if (type == KEY_UNSIGNED)
+		return mp_encode_uint(pos, key);
+	char str[32];
+	int len = snprintf(str, sizeof(str), "key-%016llu",
+			   (unsigned long long)key);
+	return mp_encode_str(pos, str, len);
+}
+
+/*
+ * Fill the buffer with a select response of the source number i out of
+ * k, its keys are i, i + k, i + 2k, ... so the merge interleaves all
+ * sources.
+ */
+static int
+source_buf_create(struct ibuf *buf, enum key_type type, uint32_t k,
+		  uint32_t i, uint32_t rows)
+{
+	size_t size = 16 + (size_t)rows * 64;
+	memset(buf, 0, sizeof(*buf));
+	buf->buf = (char *)malloc(size);
+	if (buf->buf == NULL)
+		return -1;
+	char *pos = buf->buf;
+	pos = mp_encode_map(pos, 1);
+	pos = mp_encode_uint(pos, IPROTO_DATA);
+	pos = mp_encode_array(pos, rows);
+	for (uint32_t row = 0; row < rows; ++row) {
+		pos = mp_encode_array(pos, 2);
+		pos = encode_key(pos, type, (uint64_t)row * k + i);
+		pos = mp_encode_str(pos, payload, sizeof(payload) - 1);
+	}
+	assert(pos <= buf->buf + size);
+	buf->rpos = buf->buf;
+	buf->wpos = pos;
+	buf->end = buf->buf + size;
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Merge all sources once, return the merge time in seconds. */
+static double
+merge_run(struct merger *merger, struct source *sources,
+	  struct ibuf *bufs, uint32_t k)
+{
+	double start = now();
+	merger_heap_create(&merger->heap);
+	for (uint32_t i = 0; i < k; ++i) {
+		struct ibuf *buf = &bufs[i];
+		buf->rpos = buf->buf;
+		if (mp_typeof(*buf->rpos) != MP_MAP ||
+		    mp_decode_map((const char **)&buf->rpos) != 1 ||
+		    mp_typeof(*buf->rpos) != MP_UINT ||
+		    mp_decode_uint((const char **)&buf->rpos) != IPROTO_DATA ||
+		    mp_typeof(*buf->rpos) != MP_ARRAY)
+			abort();
+		mp_decode_array((const char **)&buf->rpos);
+		sources[i].buf = buf;
+		source_fetch(&sources[i], merger);
+		if (sources[i].tuple != NULL)
+			merger_heap_insert(&merger->heap, &sources[i].hnode);
+	}
+	struct heap_node *hnode;
+	while ((hnode = merger_heap_top(&merger->heap)) != NULL) {
+		struct source *source = container_of(hnode, struct source,
+						     hnode);
+		source_fetch(source, merger);
+		if (source->tuple == NULL)
+			merger_heap_delete(&merger->heap, hnode);
+		else
+			merger_heap_update(&merger->heap, hnode);
+	}
+	merger_heap_destroy(&merger->heap);
+	return now() - start;
+}
+
+static int
+bench(enum key_type type, uint32_t k, uint32_t rows, uint32_t repeat)
+{
+	struct ibuf *bufs = (struct ibuf *)calloc(k, sizeof(*bufs));
+	struct source *sources = (struct source *)calloc(k, sizeof(*sources));
+	if (bufs == NULL || sources == NULL) {
+		free(bufs);
+		free(sources);
+		return -1;
+	}
+	int rc = 0;
+	uint32_t created = 0;
+	for (; created < k; ++created) {
+		uint32_t source_rows = rows / k + (created < rows % k);
+		if (source_buf_create(&bufs[created], type, k, created,
+				      source_rows) != 0) {
+			rc = -1;
+			goto cleanup;
+		}
+	}
+	struct merger merger;
+	memset(&merger, 0, sizeof(merger));
+	merger.type = type;
+	double best = 0;
+	for (uint32_t r = 0; r < repeat; ++r) {
+		merger.tuples = 0;
+		merger.comparisons = 0;
+		double time = merge_run(&merger, sources, bufs, k);
+		if (r == 0 || time < best)
+			best = time;
+	}
+	if (merger.tuples != rows)
+		abort();
+	printf("%-8s %5u %9u %10.3f %10.2f %8.1f %8.2f\n",
+	       key_type_strs[type], k, rows, best * 1e3,
+	       rows / best / 1e6, best * 1e9 / rows,
+	       (double)merger.comparisons / rows);
+cleanup:
+	for (uint32_t i = 0; i < created; ++i)
+		free(bufs[i].buf);
+	free(bufs);
+	free(sources);
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint32_t sources[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint32_t default_rows[] = { 10000, 1000000 };
+	uint32_t *rows = default_rows;
+	uint32_t rows_count = 2;
+	uint32_t repeat = 5;
+	uint32_t arg_rows;
+	if (argc > 1) {
+		arg_rows = strtoul(argv[1], NULL, 10);
+		rows = &arg_rows;
+		rows_count = 1;
+	}
+	if (argc > 2)
+		repeat = strtoul(argv[2], NULL, 10);
+	if (repeat == 0 || rows[0] == 0) {
+		fprintf(stderr, "Usage: %s [rows [repeat]]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-8s %5s %9s %10s %10s %8s %8s\n", "key", "K", "rows",
+	       "time, ms", "Mtuple/s", "ns/tuple", "cmp/tuple");
+	for (int type = 0; type < key_type_MAX; ++type) {
+		for (uint32_t r = 0; r < rows_count; ++r) {
+			for (size_t i = 0; i < sizeof(sources) /
+			     sizeof(sources[0]); ++i) {
+				if (bench((enum key_type)type, sources[i],
+					  rows[r], repeat) != 0) {
+					fprintf(stderr, "Can't alloc sources\n");
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
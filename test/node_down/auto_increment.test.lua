@@ -18,7 +18,7 @@ batch:q_end()
 
 shard.wait_operations()
 box.space.demo:select()
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 test_run:cmd("cleanup server master1")
 test_run:cmd("restart server default with cleanup=1")
@@ -18,7 +18,7 @@ _ = test_run:cmd("stop server master1")
 
 shard.wait_operations()
 box.space.demo:select()
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 -- check for operation q_insert is in shard
 shard.demo:check_operation(6, 0)
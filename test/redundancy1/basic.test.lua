@@ -38,6 +38,8 @@ shard.demo2:secondary_select(1, {}, {2})
 shard.demo2:secondary_select(1, {}, {2, 10})
 shard.demo2:secondary_select(1, {}, {2, 200})
 shard.demo2:secondary_select(1, {limit = 3}, {2, 80})
+shard.demo2:secondary_select(1, {fields = {1}}, {2})
+shard.demo2:secondary_select(1, {fields = {3, 1}, limit = 3}, {2})
 
 _ = test_run:cmd("stop server master1")
 _ = test_run:cmd("stop server master2")
@@ -26,7 +26,7 @@ shard.wait_operations()
 box.space.demo:select()
 test_run:cmd("switch default")
 
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 -- check for operation q_insert is in shard
 shard.demo:check_operation(6, 0)
@@ -0,0 +1,41 @@
+env = require('test_run')
+test_run = env.new()
+test_run:cmd("create server master1 with script='redundancy1/master1.lua'")
+test_run:cmd("create server master2 with script='redundancy1/master2.lua'")
+test_run:cmd("start server master1")
+test_run:cmd("start server master2")
+shard.wait_connection()
+
+-- handled operations of different age and unhandled ones
+operations = box.space._shard_operations
+now = fiber.time()
+_ = operations:insert{'op1', 2, {}, now - 300}
+_ = operations:insert{'op2', 2, {}, now - 200}
+_ = operations:insert{'op3', 2, {}, now - 100}
+_ = operations:insert{'op4', 2, {}, now}
+_ = operations:insert{'op5', 0, {}, now - 400}
+-- an operation pushed by a router that doesn't stamp operations
+_ = operations:insert{'op6', 0, {}}
+operations:len()
+
+-- operations_max: the oldest handled operations go first
+shard.collect_operations(nil, 5)
+operations:get('op1') == nil
+operations:len()
+
+-- operations_ttl
+shard.collect_operations(150)
+operations:get('op2') == nil
+shard.collect_operations(3600)
+operations:len()
+
+-- unhandled operations are never collected
+shard.collect_operations(nil, 0)
+operations:len()
+operations:get('op5') ~= nil and operations:get('op6') ~= nil
+
+_ = test_run:cmd("stop server master1")
+_ = test_run:cmd("stop server master2")
+test_run:cmd("cleanup server master1")
+test_run:cmd("cleanup server master2")
+test_run:cmd("restart server default with cleanup=1")
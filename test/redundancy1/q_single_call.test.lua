@@ -0,0 +1,50 @@
+env = require('test_run')
+test_run = env.new()
+test_run:cmd("create server master1 with script='redundancy1/master1.lua'")
+test_run:cmd("create server master2 with script='redundancy1/master2.lua'")
+test_run:cmd("start server master1")
+test_run:cmd("start server master2")
+shard.wait_connection()
+set_single_call(true)
+
+-- biphase operations pushed and executed with a single call
+shard.demo:q_insert(1, {0, 'test'})
+shard.demo:q_replace(2, {0, 'test2'})
+shard.demo:q_update(3, 0, {{'=', 2, 'test3'}})
+shard.demo:q_insert(4, {1, 'test4'})
+shard.demo:q_insert(5, {2, 'test_to_delete'})
+shard.demo:q_delete(6, 2)
+
+-- operations are applied without waiting for workers
+test_run:cmd("switch master2")
+box.space.demo:select()
+box.space._shard_operations:get('1')[2]
+test_run:cmd("switch default")
+
+-- check for operation is in shard after a single call
+shard.demo:check_operation(1, 0)
+shard.demo:check_operation(6, 2)
+
+-- operation pushed once again is not applied twice
+shard.demo:q_insert(1, {0, 'test'})
+
+-- failed batch is rolled back, concurrent batches are committed
+ch = fiber.channel(2)
+_ = fiber.create(function() op7 = pcall(shard.demo.q_insert, shard.demo, 7, {1, 'dup'}) ch:put(true) end)
+_ = fiber.create(function() op8 = pcall(shard.demo.q_replace, shard.demo, 8, {1, 'test8'}) ch:put(true) end)
+ch:get(), ch:get()
+op7, op8
+shard.demo:check_operation(7, 1)
+shard.demo:check_operation(8, 1)
+
+test_run:cmd("switch master2")
+box.space.demo:select()
+box.space._shard_operations:get('7')
+test_run:cmd("switch default")
+
+set_single_call(false)
+_ = test_run:cmd("stop server master1")
+_ = test_run:cmd("stop server master2")
+test_run:cmd("cleanup server master1")
+test_run:cmd("cleanup server master2")
+test_run:cmd("restart server default with cleanup=1")
@@ -0,0 +1,54 @@
+env = require('test_run')
+test_run = env.new()
+test_run:cmd("create server master1 with script='redundancy1/master1.lua'")
+test_run:cmd("create server master2 with script='redundancy1/master2.lua'")
+test_run:cmd("start server master1")
+test_run:cmd("start server master2")
+shard.wait_connection()
+set_cache({demo = {size = 10}})
+
+-- a select is served from the cache
+shard.demo:insert{0, 'a'}
+shard.demo:select{0}
+test_run:cmd("switch master2")
+_ = box.space.demo:replace{0, 'b'}
+test_run:cmd("switch default")
+shard.demo:select{0}
+shard.stats().operations.cached_select.count
+
+-- a write through the router invalidates the key
+shard.demo:replace{0, 'c'}
+shard.demo:select{0}
+
+-- two-phase operations invalidate the key
+shard.demo:q_replace(1, {0, 'd'})
+shard.demo:select{0}
+
+-- caches are dropped on reload_schema
+test_run:cmd("switch master2")
+_ = box.space.demo:replace{0, 'e'}
+test_run:cmd("switch default")
+shard.demo:select{0}
+_ = shard.reload_schema()
+shard.demo:select{0}
+
+-- caches are dropped when resharding state changes
+test_run:cmd("switch master2")
+_ = box.space.demo:replace{0, 'f'}
+test_run:cmd("switch default")
+shard.demo:select{0}
+_ = box.space._shard:replace{'RESHARDING', 1}
+shard.demo:select{0}
+_ = box.space._shard:replace{'RESHARDING', 0}
+
+-- the cache of a truncated space is dropped
+shard.demo:select{0}
+shard.demo:truncate()
+shard.demo:select{0}
+
+set_cache(nil)
+_ = test_run:cmd("stop server master1")
+_ = test_run:cmd("stop server master2")
+test_run:cmd("cleanup server master1")
+test_run:cmd("cleanup server master2")
+test_run:cmd("restart server default with cleanup=1")
@@ -0,0 +1,36 @@
+env = require('test_run')
+test_run = env.new()
+test_run:cmd("create server master1 with script='redundancy1/master1.lua'")
+test_run:cmd("create server master2 with script='redundancy1/master2.lua'")
+test_run:cmd("start server master1")
+test_run:cmd("start server master2")
+shard.wait_connection()
+
+-- a pass over demo interrupted after the tuple 5
+for i = 1, 10 do box.space.demo:insert{i, 'scan'} end
+_ = box.space._shard_worker:create_index('lookup', {parts = {3, 'unsigned'}})
+_ = box.space._shard:replace{'RESHARDING', 1}
+_ = box.space._shard:replace{'HANDLED_SPACES', {}}
+_ = box.space._shard:replace{'CUR_SPACE', 'demo'}
+_ = box.space._shard:replace{'FINISHED_SPACE', ''}
+_ = box.space._shard:replace{'SCAN_CURSOR:demo', 'demo', 1, {5}}
+box.snapshot()
+test_run:cmd("restart server default")
+test_run = require('test_run').new()
+shard.wait_connection()
+
+-- the pass is resumed from the cursor, tuples 6..10 are scanned
+function scanned(space) while box.space._shard:get{'FINISHED_SPACE'}[2] ~= space do fiber.sleep(0.001) end return resharding_status().metrics[space].scanned end
+shard:enable_resharding()
+scanned('demo')
+
+-- the final pass starts a new epoch
+while box.space._shard:get{'RESHARDING'}[2] ~= 0 do fiber.sleep(0.01) end
+box.space._shard:get{'SCAN_CURSOR:demo'}
+shard:disable_resharding()
+
+_ = test_run:cmd("stop server master1")
+_ = test_run:cmd("stop server master2")
+test_run:cmd("cleanup server master1")
+test_run:cmd("cleanup server master2")
+test_run:cmd("restart server default with cleanup=1")
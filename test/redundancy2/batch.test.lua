@@ -25,7 +25,7 @@ test_run:cmd("switch master2")
 shard.wait_operations()
 box.space.demo:select()
 
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 test_run:cmd("switch default")
 
@@ -28,6 +28,9 @@ test_run:cmd("switch default")
 shard.demo:check_operation(1, 0)
 -- check for not exists operations
 shard.demo:check_operation('12345', 0)
+-- check a bunch of operations at once
+r = shard.demo:check_operations({{1, 0}, {4, 1}, {'12345', 0}})
+r['1'], r['4'], r['12345']
 
 _ = test_run:cmd("stop server master1")
 _ = test_run:cmd("stop server master2")
@@ -26,7 +26,7 @@ shard.wait_operations()
 box.space.demo:select()
 test_run:cmd("switch default")
 
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 _ = test_run:cmd("stop server master1")
 _ = test_run:cmd("stop server master2")
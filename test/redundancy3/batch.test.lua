@@ -31,7 +31,7 @@ shard.demo:check_operation(6, 0)
 -- check for not exists operations
 shard.demo:check_operation('12345', 0)
 
-box.space._shard_operations:select()
+box.space._shard_operations:pairs():map(decode_operation):totable()
 
 _ = test_run:cmd("stop server master1")
 _ = test_run:cmd("stop server master2")
@@ -2,6 +2,7 @@
 shard = require('shard')
 os = require('os')
 fiber = require('fiber')
+msgpack = require('msgpack')
 
 local cfg = {
     servers = {
@@ -12,6 +13,7 @@ local cfg = {
     login = 'tester';
     password = 'pass';
     redundancy = 3;
+    q_coded_operations = true;
     binary = 33130;
 }
 
@@ -44,6 +46,15 @@ function print_shard_map()
     return result
 end
 
+-- _shard_operations tuple with decoded arguments of the batch
+function decode_operation(t)
+    local ops = {}
+    for i, op in ipairs(t[3]) do
+        ops[i] = {op[1], op[2], (msgpack.decode(op[3]))}
+    end
+    return box.tuple.new{t[1], t[2], ops}
+end
+
 -- init shards
 fiber.create(function()
     shard.init(cfg)